@@ -36,11 +36,23 @@ extern "C" {
 #endif
 
 typedef struct Edge264Decoder Edge264Decoder;
+typedef struct Edge264Pool Edge264Pool;
+
+// flags for edge264_alloc
+#define EDGE264_LOG_MBS 1 // log every macroblock (with log_cb)
+#define EDGE264_FIFO_TASKS 2 // run slices in decoding order instead of critical path first
+#define EDGE264_DEBLOCK_STAGE 4 // deblock slices on a second worker one row behind their decoding
+#define EDGE264_RECON_STAGE 8 // reconstruct samples of slices starting a frame on other workers behind their parsing
+#define EDGE264_CALLER_TASKS 16 // run ready slices in the calling thread while it waits for workers
+#define EDGE264_HUGE_PAGES 32 // allocate large frames in 2 MiB pages where supported (without alloc_cb)
+#define EDGE264_NV12 64 // output chroma as a single plane of interleaved Cb and Cr samples
+#define EDGE264_MB_WINDOW 128 // without multithreading, decode non-reference pictures with a few rows of macroblock data instead of a full frame of it (if their first slice starts at macroblock 0, falling back to a full frame on slices out of order)
 
 typedef int (*Edge264LogCb)(const char *str, void *log_arg);
 typedef void (*Edge264UnrefCb)(int ret, void *unref_arg);
 typedef void (*Edge264AllocCb)(void **samples, unsigned samples_size, void **mbs, unsigned mbs_size, int errno_on_fail, void *alloc_arg);
 typedef void (*Edge264FreeCb)(void *samples, void *mbs, void *alloc_arg);
+typedef void (*Edge264FrameCb)(void *frame_arg);
 
 typedef struct Edge264Frame {
 	const uint8_t *samples[3]; // Y/Cb/Cr planes
@@ -59,15 +71,29 @@ typedef struct Edge264Frame {
 	int32_t FrameId_mvc; // second view
 	int16_t frame_crop_offsets[4]; // {top,right,bottom,left}, useful to derive the original frame with 16x16 macroblocks
 	void *return_arg;
+	int16_t final_rows_Y; // number of rows from the top of samples[0] that are final, height_Y for frames from edge264_get_frame
+	int8_t interleaved_CbCr; // 1 with EDGE264_NV12, samples[1] then points to Cb/Cr pairs and samples[2] to the first Cr sample
 } Edge264Frame;
 
+typedef int (*Edge264OutputCb)(const Edge264Frame *frame, void *output_arg);
+
 const uint8_t *edge264_find_start_code(const uint8_t *buf, const uint8_t *end, int four_byte);
-Edge264Decoder *edge264_alloc(int n_threads, Edge264LogCb log_cb, void *log_arg, int log_mbs, Edge264AllocCb alloc_cb, Edge264FreeCb free_cb, void *alloc_arg);
+Edge264Decoder *edge264_alloc(int n_threads, Edge264LogCb log_cb, void *log_arg, int flags, Edge264AllocCb alloc_cb, Edge264FreeCb free_cb, void *alloc_arg);
+void edge264_set_frame_cb(Edge264Decoder *dec, Edge264FrameCb frame_cb, void *frame_arg);
+void edge264_set_max_workers(Edge264Decoder *dec, int max_workers);
+Edge264Pool *edge264_pool_alloc(int n_threads, const int *cpus);
+void edge264_pool_set_spin(Edge264Pool *pool, int spin_count);
+void edge264_pool_get_spin_stats(Edge264Pool *pool, unsigned *spin_hits, unsigned *spin_misses);
+int edge264_pool_attach(Edge264Pool *pool, Edge264Decoder *dec);
+void edge264_pool_free(Edge264Pool **ppool);
+int edge264_decode_gops(Edge264Pool *pool, int n_decoders, const uint8_t *buf, const uint8_t *end, int flags, Edge264OutputCb output_cb, void *output_arg);
 void edge264_flush(Edge264Decoder *dec);
 void edge264_free(Edge264Decoder **pdec);
 int edge264_decode_NAL(Edge264Decoder *dec, const uint8_t *buf, const uint8_t *end, Edge264UnrefCb unref_cb, void *unref_arg);
 int edge264_get_frame(Edge264Decoder *dec, Edge264Frame *out, int borrow);
+int edge264_peek_frame(Edge264Decoder *dec, Edge264Frame *out);
 void edge264_return_frame(Edge264Decoder *dec, void *return_arg);
+void edge264_get_buffer_stats(Edge264Decoder *dec, unsigned *allocs, unsigned *reuses, unsigned *spares);
 
 #ifdef __cplusplus
 }
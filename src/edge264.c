@@ -19,11 +19,8 @@
  * 	_ add an option to forbid slice threading, to make redundant slices reliable
  * 	_ measure the time it takes to decode each type of slice
  * 	_ initialize next_deblock_idc at context_init rather than task to catch the latest nda value
- * 	_ make tasks start without waiting for availabilities, and wait inside all separate mv parsers
- * 	_ progressively replace waits with per-mb waits
  * 	_ limit n_threads and inferred CPUs to 16
  * 	_ remove taskPic now to remove a source of false sharing
- * 	_ try to improve parallel decoding of frames with disable_deblocking_idc==2
  * 	_ Update DPB availability checks to take deps into account, and make sure we wait until there is a frame ready before returning -2
  * 	_ Add currPic to task_dependencies
  * 	_ Add a mask of pending tasks
@@ -36,7 +33,6 @@
  * 	_ Create a single worker thread and use it to decode each slice
  * 	_ Add debug output to signal start and end of worker assignment
  * 	_ add an option to store N more frames, to tolerate lags in process scheduling
- * 	_ make reference dependencies be waited in each mb with conditions on minimum values of next_deblock_addr, like ffmpeg does
  * 	_ Windows fallback functions
  * 	_ Switch back convention to never allow CPB past end because of risk of pointer overflow!
  * 	_ Change edge264_test to avoid counting mmap time in benchmark (check if ffmpeg does it too to be fair)
@@ -122,13 +118,191 @@ const uint8_t *edge264_find_start_code(const uint8_t *buf, const uint8_t *end, i
 
 static void internal_alloc(void **samples, unsigned samples_size, void **mbs, unsigned mbs_size, int errno_on_fail, void *alloc_arg) {
 	*samples = aligned_alloc(16, samples_size + mbs_size);
-	*mbs = *samples + samples_size;
+	*mbs = *samples != NULL ? (uint8_t *)*samples + samples_size : NULL;
 }
 
 static void internal_free(void *samples, void *mbs, void *alloc_arg) {
 	free(samples);
 }
 
+/**
+ * With EDGE264_HUGE_PAGES, frames of at least half a huge page are aligned and
+ * sized to whole huge pages, and advised to be backed by them. Reference
+ * fetches then hop across rows without a TLB miss at each one. Without
+ * transparent huge pages the kernel ignores the advice and keeps 4 KiB pages.
+ * The padding is a mere preference, so if it cannot be allocated the frame
+ * falls back to internal_alloc, and fails with errno_on_fail only as it would.
+ */
+#define HUGE_PAGE_SIZE (2u << 20)
+static void internal_alloc_huge(void **samples, unsigned samples_size, void **mbs, unsigned mbs_size, int errno_on_fail, void *alloc_arg) {
+	#if defined(__linux__) && defined(MADV_HUGEPAGE)
+		size_t size = samples_size + mbs_size;
+		if (size >= HUGE_PAGE_SIZE / 2) {
+			size = (size + HUGE_PAGE_SIZE - 1) & -(size_t)HUGE_PAGE_SIZE;
+			if ((*samples = aligned_alloc(HUGE_PAGE_SIZE, size)) != NULL) {
+				madvise(*samples, size, MADV_HUGEPAGE);
+				*mbs = (uint8_t *)*samples + samples_size;
+				return;
+			}
+		}
+	#endif
+	internal_alloc(samples, samples_size, mbs, mbs_size, errno_on_fail, alloc_arg);
+}
+
+#ifdef __linux__
+	// NUMA node of a CPU from the nodeN entry in its sysfs directory, or -1 if unknown
+	static int cpu_node(int cpu) {
+		char path[48];
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+		DIR *d = opendir(path);
+		int node = -1;
+		for (struct dirent *e; d != NULL && node < 0 && (e = readdir(d)) != NULL; ) {
+			if (strncmp(e->d_name, "node", 4) == 0 && e->d_name[4] >= '0' && e->d_name[4] <= '9')
+				node = atoi(e->d_name + 4);
+		}
+		if (d != NULL)
+			closedir(d);
+		return node;
+	}
+#endif
+
+static int count_logical_cores(void) {
+	#ifdef _WIN32
+		return atoi(getenv("NUMBER_OF_PROCESSORS"));
+	#else
+		return sysconf(_SC_NPROCESSORS_ONLN);
+	#endif
+}
+
+/**
+ * Wait until every worker that was visiting decoders has left them, after
+ * which none of them can still see what was removed from pool->decoders.
+ * Called with pool->lock held and pool->syncing set.
+ */
+static void wait_scans(Edge264Pool *pool) {
+	for (int i = 0; i < pool->n_threads; i++) {
+		uint32_t scan = __atomic_load_n(&pool->scans[i][0], __ATOMIC_SEQ_CST);
+		for (uint32_t seq; (scan & 1) && (seq = __atomic_load_n(&pool->sync_seq, __ATOMIC_ACQUIRE),
+		     __atomic_load_n(&pool->scans[i][0], __ATOMIC_ACQUIRE) == scan); )
+			park(pool, &pool->sync_seq, seq);
+	}
+}
+
+// signal a thread in wait_scans or detach_pool that a worker left a decoder
+static void signal_sync(Edge264Pool *pool) {
+	if (__atomic_load_n(&pool->syncing, __ATOMIC_SEQ_CST)) {
+		__atomic_add_fetch(&pool->sync_seq, 1, __ATOMIC_RELEASE);
+		unpark(pool, &pool->sync_seq);
+	}
+}
+
+/**
+ * Workers visit the decoders attached to their pool in round-robin order, and
+ * reserve a ready task from the first one having any, without locking. While
+ * visiting, their scans word is odd so that decoders are not freed under them.
+ * Until the task completes, a worker holds the decoder to prevent its removal
+ * from the pool.
+ */
+static void *pool_loop(void *arg) {
+	Edge264Pool *pool = (void *)((uintptr_t)arg & -64);
+	int thread_id = (uintptr_t)arg & 63;
+	uint32_t *scan = &pool->scans[thread_id][0];
+	while (1) {
+		uint32_t seq = __atomic_load_n(&pool->task_seq, __ATOMIC_ACQUIRE);
+		__atomic_store_n(scan, *scan + 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&pool->stop_workers, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(scan, *scan + 1, __ATOMIC_SEQ_CST);
+			return NULL;
+		}
+		Edge264Decoder *dec = NULL;
+		int task_id = -1, more = 0;
+		int n = __atomic_load_n(&pool->n_decoders, __ATOMIC_SEQ_CST);
+		Edge264Decoder **decoders = __atomic_load_n(&pool->decoders, __ATOMIC_SEQ_CST);
+		unsigned first = __atomic_fetch_add(&pool->next_decoder, 1, __ATOMIC_RELAXED);
+		for (int i = 0; i < n && !more; i++) {
+			Edge264Decoder *d = __atomic_load_n(&decoders[(first + i) % n], __ATOMIC_SEQ_CST);
+			if (d == NULL)
+				continue;
+			if (dec != NULL) {
+				more = ready_tasks(d) != 0;
+				continue;
+			}
+			// the budget is checked before claiming, so concurrent claims may exceed it briefly
+			task_id = claim_task(d, __atomic_load_n(&d->pool_holds, __ATOMIC_RELAXED) >= worker_budget(d));
+			if (task_id >= 0) {
+				dec = d;
+				__atomic_add_fetch(&dec->pool_holds, 1, __ATOMIC_RELAXED);
+				more = ready_tasks(dec) != 0;
+			}
+		}
+		__atomic_store_n(scan, *scan + 1, __ATOMIC_SEQ_CST);
+		signal_sync(pool);
+		if (dec == NULL) {
+			// poll for new tasks a little before parking, trading CPU time for wake-up latency
+			int spins = __atomic_load_n(&pool->spin_count, __ATOMIC_RELAXED);
+			if (spins > 0) {
+				while (__atomic_load_n(&pool->task_seq, __ATOMIC_ACQUIRE) == seq && --spins > 0)
+					spin_pause();
+				if (spins > 0) {
+					__atomic_add_fetch(&pool->spin_hits, 1, __ATOMIC_RELAXED);
+					continue;
+				}
+				__atomic_add_fetch(&pool->spin_misses, 1, __ATOMIC_RELAXED);
+			}
+			__atomic_add_fetch(&pool->parked_workers, 1, __ATOMIC_SEQ_CST);
+			park(pool, &pool->task_seq, seq);
+			__atomic_sub_fetch(&pool->parked_workers, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		
+		// pass on to another idle worker if other tasks are ready
+		if (more) {
+			wake_workers(pool);
+		}
+		dec->run_task(dec, task_id, thread_id);
+		__atomic_sub_fetch(&dec->pool_holds, 1, __ATOMIC_SEQ_CST);
+		signal_sync(pool);
+	}
+}
+
+/**
+ * Drop the tasks of a decoder not started yet, interrupt the others and wait
+ * until they are complete, then remove it from its pool. Frames are marked
+ * complete to release any task waiting on a reference that will never finish.
+ */
+static void detach_pool(Edge264Decoder *dec) {
+	Edge264Pool *pool = dec->pool;
+	__atomic_store_n(&dec->cancel_tasks, 1, __ATOMIC_RELEASE);
+	drop_pending_tasks(dec);
+	for (uint32_t seq; seq = __atomic_load_n(&dec->task_releases, __ATOMIC_ACQUIRE), __atomic_load_n(&dec->busy_tasks, __ATOMIC_ACQUIRE); ) {
+		for (int i = 0; i < 32; i++) {
+			__atomic_store_n(&dec->next_deblock_addr[i], INT_MAX, __ATOMIC_RELEASE);
+			unpark(pool, &dec->next_deblock_addr[i]);
+		}
+		park(pool, &dec->task_releases, seq);
+	}
+	pthread_mutex_lock(&pool->lock);
+	int i = 0;
+	while (pool->decoders[i] != dec)
+		i++;
+	__atomic_store_n(&pool->decoders[i], NULL, __ATOMIC_SEQ_CST);
+	int n = pool->n_decoders;
+	while (n > 0 && pool->decoders[n - 1] == NULL)
+		n--;
+	__atomic_store_n(&pool->n_decoders, n, __ATOMIC_RELEASE);
+	__atomic_store_n(&pool->syncing, 1, __ATOMIC_SEQ_CST);
+	wait_scans(pool);
+	for (uint32_t seq; seq = __atomic_load_n(&pool->sync_seq, __ATOMIC_ACQUIRE), __atomic_load_n(&dec->pool_holds, __ATOMIC_SEQ_CST) > 0; )
+		park(pool, &pool->sync_seq, seq); // workers are about to release the decoder
+	__atomic_store_n(&pool->syncing, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&pool->lock);
+	pthread_mutex_destroy(&dec->merge_lock);
+	pthread_mutex_destroy(&dec->parse_lock);
+	pthread_mutex_destroy(&dec->lock);
+	dec->pool = NULL;
+	dec->n_threads = 0;
+}
+
 static int ignore_NAL(Edge264Decoder *dec, Edge264UnrefCb unref_cb, void *unref_arg) {
 	return 0;
 }
@@ -139,7 +313,7 @@ static int unsup_NAL(Edge264Decoder *dec, Edge264UnrefCb unref_cb, void *unref_a
 
 
 
-Edge264Decoder *edge264_alloc(int n_threads, Edge264LogCb log_cb, void *log_arg, int log_mbs, Edge264AllocCb alloc_cb, Edge264FreeCb free_cb, void *alloc_arg) {
+Edge264Decoder *edge264_alloc(int n_threads, Edge264LogCb log_cb, void *log_arg, int flags, Edge264AllocCb alloc_cb, Edge264FreeCb free_cb, void *alloc_arg) {
 	Edge264Decoder *dec = aligned_alloc(64, sizeof(*dec)); // maximal SIMD type alignment used in edge264
 	if (dec == NULL)
 		return NULL;
@@ -147,18 +321,26 @@ Edge264Decoder *edge264_alloc(int n_threads, Edge264LogCb log_cb, void *log_arg,
 	dec->log_base_us = get_relative_time_us();
 	dec->currPic = dec->basePic = -1;
 	dec->PrevRefFrameNum[0] = dec->PrevRefFrameNum[1] = dec->prevFrameId = -1;
-	dec->taskPics_v = dec->output_queue_v[0][0] = dec->output_queue_v[0][1] =
+	memset(dec->taskPics, -1, sizeof(dec->taskPics));
+	dec->output_queue_v[0][0] = dec->output_queue_v[0][1] =
 		dec->output_queue_v[1][0] = dec->output_queue_v[1][1] = set8(-1);
-	dec->n_threads = n_threads;
 	dec->max_output_latency = 16;
-	dec->alloc_cb = alloc_cb && free_cb ? alloc_cb : internal_alloc;
+	dec->task_slots = 0xffff;
+	dec->fifo_tasks = (flags & EDGE264_FIFO_TASKS) != 0;
+	dec->deblock_stage = (flags & EDGE264_DEBLOCK_STAGE) != 0;
+	dec->recon_stage = (flags & EDGE264_RECON_STAGE) != 0;
+	dec->caller_tasks = (flags & EDGE264_CALLER_TASKS) != 0;
+	dec->nv12 = (flags & EDGE264_NV12) != 0;
+	dec->mb_window = (flags & EDGE264_MB_WINDOW) != 0;
+	dec->alloc_cb = alloc_cb && free_cb ? alloc_cb : flags & EDGE264_HUGE_PAGES ? internal_alloc_huge : internal_alloc;
 	dec->free_cb = alloc_cb && free_cb ? free_cb : internal_free;
+	dec->internal_alloc = !(alloc_cb && free_cb);
 	dec->alloc_arg = alloc_arg;
 	dec->log_cb = log_cb;
 	dec->log_arg = log_arg;
 	
 	// select parser functions based on CPU capabilities and logs mode
-	dec->worker_loop = ADD_VARIANT(worker_loop);
+	dec->run_task = ADD_VARIANT(run_task);
 	for (int i = 0; i < 32; i++)
 		dec->parse_nal_unit[i] = unsup_NAL;
 	dec->parse_nal_unit[1] = dec->parse_nal_unit[5] = ADD_VARIANT(parse_slice_layer_without_partitioning);
@@ -177,7 +359,7 @@ Edge264Decoder *edge264_alloc(int n_threads, Edge264LogCb log_cb, void *log_arg,
 			__builtin_cpu_supports("sse4.1") &&
 			__builtin_cpu_supports("sse4.2") &&
 			__builtin_cpu_supports("ssse3")) {
-			dec->worker_loop = worker_loop_v2;
+			dec->run_task = run_task_v2;
 			dec->parse_nal_unit[1] = dec->parse_nal_unit[5] = parse_slice_layer_without_partitioning_v2;
 			dec->parse_nal_unit[7] = dec->parse_nal_unit[15] = parse_seq_parameter_set_v2;
 			dec->parse_nal_unit[8] = parse_pic_parameter_set_v2;
@@ -191,7 +373,7 @@ Edge264Decoder *edge264_alloc(int n_threads, Edge264LogCb log_cb, void *log_arg,
 			__builtin_cpu_supports("bmi") &&
 			__builtin_cpu_supports("bmi2") &&
 			__builtin_cpu_supports("fma")) {
-			dec->worker_loop = worker_loop_v3;
+			dec->run_task = run_task_v3;
 			dec->parse_nal_unit[1] = dec->parse_nal_unit[5] = parse_slice_layer_without_partitioning_v3;
 			dec->parse_nal_unit[7] = dec->parse_nal_unit[15] = parse_seq_parameter_set_v3;
 			dec->parse_nal_unit[8] = parse_pic_parameter_set_v3;
@@ -211,62 +393,417 @@ Edge264Decoder *edge264_alloc(int n_threads, Edge264LogCb log_cb, void *log_arg,
 			dec->parse_nal_unit[10] = parse_end_of_sequence_log;
 			dec->parse_nal_unit[11] = dec->parse_nal_unit[12] = ignore_NAL_log;
 			dec->parse_nal_unit[14] = dec->parse_nal_unit[20] = parse_nal_unit_header_extension_log;
-			if (log_mbs)
-				dec->worker_loop = worker_loop_log;
+			if (flags & EDGE264_LOG_MBS)
+				dec->run_task = run_task_log;
 		}
 	#else
 		if (log_cb)
 			return free(dec), NULL;
 	#endif
 	
-	// get the number of logical cores if requested
-	if (n_threads < 0) {
-		#ifdef _WIN32
-			int n_cpus = atoi(getenv("NUMBER_OF_PROCESSORS"));
-		#else
-			int n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
-		#endif
-		n_threads = min(n_cpus, 16);
-	}
-	
-	// if multithreading is disabled we are done, otherwise initialize all
+	// if multithreading is disabled we are done, otherwise start a private pool
 	if (n_threads == 0)
 		return dec;
-	if (pthread_mutex_init(&dec->lock, NULL) == 0) {
-		if (pthread_cond_init(&dec->task_ready, NULL) == 0) {
-			if (pthread_cond_init(&dec->task_progress, NULL) == 0) {
-				if (pthread_cond_init(&dec->task_complete, NULL) == 0) {
-					int i = 0;
-					while (i < n_threads && pthread_create(&dec->threads[i], NULL, dec->worker_loop, (void *)((uintptr_t)dec + i)) == 0)
+	Edge264Pool *pool = edge264_pool_alloc(n_threads < 0 ? min(count_logical_cores(), 64) : min(n_threads, 64), NULL);
+	if (pool != NULL) {
+		if (edge264_pool_attach(pool, dec) == 0) {
+			dec->own_pool = 1;
+			return dec;
+		}
+		edge264_pool_free(&pool);
+	}
+	free(dec);
+	return NULL;
+}
+
+
+
+void edge264_set_frame_cb(Edge264Decoder *dec, Edge264FrameCb frame_cb, void *frame_arg) {
+	if (dec == NULL)
+		return;
+	dec->frame_cb = frame_cb;
+	dec->frame_arg = frame_arg;
+}
+
+
+
+void edge264_set_max_workers(Edge264Decoder *dec, int max_workers) {
+	if (dec == NULL || !dec->n_threads)
+		return;
+	__atomic_store_n(&dec->max_workers, min(max(max_workers, 0), dec->n_threads), __ATOMIC_RELAXED);
+	wake_workers(dec->pool);
+}
+
+
+
+Edge264Pool *edge264_pool_alloc(int n_threads, const int *cpus) {
+	int n_cpus = 0;
+	while (cpus != NULL && cpus[n_cpus] >= 0)
+		n_cpus++;
+	if (n_threads < 0)
+		n_threads = n_cpus ?: count_logical_cores();
+	if (n_threads == 0)
+		return NULL;
+	Edge264Pool *pool = aligned_alloc(64, sizeof(*pool)); // thread indices are stored in the lower bits of its address
+	if (pool == NULL)
+		return NULL;
+	memset(pool, 0, sizeof(*pool));
+	pool->n_threads = n_threads = min(n_threads, 64);
+	pool->numa_node = -1;
+	#ifdef __linux__
+		for (int i = 0; i < n_cpus; i++) {
+			int node = cpu_node(cpus[i]);
+			if (node < 0 || node >= 256 || (i > 0 && node != pool->numa_node)) {
+				pool->numa_node = -1;
+				break;
+			}
+			pool->numa_node = node;
+		}
+	#endif
+	if (pthread_mutex_init(&pool->lock, NULL) == 0) {
+		if (pthread_mutex_init(&pool->park_lock, NULL) == 0) {
+			if (pthread_cond_init(&pool->park_cond, NULL) == 0) {
+				// workers restricted to a set of CPUs start there, so their stacks and the samples they write first are placed on its NUMA node
+				pthread_attr_t attr;
+				int i = 0;
+				if (pthread_attr_init(&attr) == 0) {
+					#ifdef __linux__
+						if (n_cpus > 0) {
+							cpu_set_t set;
+							CPU_ZERO(&set);
+							for (int j = 0; j < n_cpus; j++) {
+								if (cpus[j] < CPU_SETSIZE)
+									CPU_SET(cpus[j], &set);
+							}
+							pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+						}
+					#endif
+					while (i < n_threads && pthread_create(&pool->threads[i], &attr, pool_loop, (void *)((uintptr_t)pool + i)) == 0)
 						i++;
-					if (i == n_threads) {
-						return dec;
-					}
-					while (i-- > 0)
-						pthread_cancel(dec->threads[i]);
-					pthread_cond_destroy(&dec->task_complete);
+					pthread_attr_destroy(&attr);
 				}
-				pthread_cond_destroy(&dec->task_progress);
+				if (i == n_threads)
+					return pool;
+				pool->n_threads = i;
+				edge264_pool_free(&pool);
+				return NULL;
 			}
-			pthread_cond_destroy(&dec->task_ready);
+			pthread_mutex_destroy(&pool->park_lock);
 		}
-		pthread_mutex_destroy(&dec->lock);
+		pthread_mutex_destroy(&pool->lock);
 	}
-	free(dec);
+	free(pool);
 	return NULL;
 }
 
 
 
+void edge264_pool_set_spin(Edge264Pool *pool, int spin_count) {
+	if (pool != NULL)
+		__atomic_store_n(&pool->spin_count, max(spin_count, 0), __ATOMIC_RELAXED);
+}
+
+
+
+void edge264_pool_get_spin_stats(Edge264Pool *pool, unsigned *spin_hits, unsigned *spin_misses) {
+	if (pool == NULL)
+		return;
+	if (spin_hits != NULL)
+		*spin_hits = __atomic_load_n(&pool->spin_hits, __ATOMIC_RELAXED);
+	if (spin_misses != NULL)
+		*spin_misses = __atomic_load_n(&pool->spin_misses, __ATOMIC_RELAXED);
+}
+
+
+
+int edge264_pool_attach(Edge264Pool *pool, Edge264Decoder *dec) {
+	if (pool == NULL || dec == NULL || dec->n_threads)
+		return EINVAL;
+	if (pthread_mutex_init(&dec->lock, NULL) != 0)
+		return ENOMEM;
+	if (pthread_mutex_init(&dec->parse_lock, NULL) != 0) {
+		pthread_mutex_destroy(&dec->lock);
+		return ENOMEM;
+	}
+	if (pthread_mutex_init(&dec->merge_lock, NULL) != 0) {
+		pthread_mutex_destroy(&dec->parse_lock);
+		pthread_mutex_destroy(&dec->lock);
+		return ENOMEM;
+	}
+	pthread_mutex_lock(&pool->lock);
+	int i = 0;
+	while (i < pool->n_decoders && pool->decoders[i] != NULL)
+		i++;
+	if (i == pool->decoders_size) {
+		// workers may still visit the previous array, which is freed once they left it
+		int size = max(pool->decoders_size * 2, 8);
+		Edge264Decoder **decoders = malloc(size * sizeof(*decoders));
+		if (decoders != NULL) {
+			Edge264Decoder **prev = pool->decoders;
+			memcpy(decoders, prev, i * sizeof(*decoders));
+			__atomic_store_n(&pool->decoders, decoders, __ATOMIC_RELEASE);
+			pool->decoders_size = size;
+			__atomic_store_n(&pool->syncing, 1, __ATOMIC_SEQ_CST);
+			wait_scans(pool);
+			__atomic_store_n(&pool->syncing, 0, __ATOMIC_RELAXED);
+			free(prev);
+		}
+	}
+	int ret = ENOMEM;
+	if (i < pool->decoders_size) {
+		dec->pool = pool;
+		dec->n_threads = pool->n_threads;
+		dec->auto_workers = pool->n_threads;
+		// two slots per worker let the parser run ahead of them, with at least 16
+		int n_slots = min(max(pool->n_threads * 2, 16), 64);
+		dec->task_slots = n_slots < 64 ? (1ull << n_slots) - 1 : -1ull;
+		__atomic_store_n(&pool->decoders[i], dec, __ATOMIC_RELEASE);
+		if (i == pool->n_decoders)
+			__atomic_store_n(&pool->n_decoders, i + 1, __ATOMIC_RELEASE);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	if (ret) {
+		pthread_mutex_destroy(&dec->merge_lock);
+		pthread_mutex_destroy(&dec->parse_lock);
+		pthread_mutex_destroy(&dec->lock);
+	}
+	return ret;
+}
+
+
+
+void edge264_pool_free(Edge264Pool **ppool) {
+	Edge264Pool *pool;
+	if (ppool != NULL && (pool = *ppool) != NULL) {
+		*ppool = NULL;
+		__atomic_store_n(&pool->stop_workers, 1, __ATOMIC_RELEASE);
+		wake_workers(pool);
+		for (int i = 0; i < pool->n_threads; i++)
+			pthread_join(pool->threads[i], NULL);
+		pthread_mutex_destroy(&pool->lock);
+		pthread_mutex_destroy(&pool->park_lock);
+		pthread_cond_destroy(&pool->park_cond);
+		free(pool->decoders);
+		free(pool);
+	}
+}
+
+
+
+// return 0 for an SPS, 1 for a subset SPS and 2..5 for PPS 0..3, whose ids are the first ue(v) value, -1 otherwise
+static int param_kind(const uint8_t *nal, const uint8_t *next) {
+	int type = nal[0] & 0x1f;
+	if (type != 8 || nal + 1 >= next)
+		return type == 7 ? 0 : type == 15 ? 1 : -1;
+	return nal[1] >= 0x80 ? 2 : nal[1] >= 0x40 ? (nal[1] >> 5) + 1 : nal[1] >> 3 == 4 ? 5 : -1;
+}
+
+/**
+ * Keep the parameter sets of an access unit for replay, in stream order since
+ * parsing a PPS depends on the SPS before it. The decoder keeps a single SPS
+ * and PPS 0..3, so a new one replaces the previous of its kind, and a new SPS
+ * drops the PPSs received before it.
+ */
+static void save_params(Edge264Gops *g, const uint8_t *nal, const uint8_t *end) {
+	for (const uint8_t *next; nal < end; nal = next + 3) {
+		next = edge264_find_start_code(nal, end, 0);
+		int kind = param_kind(nal, next);
+		if (kind < 0)
+			continue;
+		int n = 0;
+		for (int i = 0; i < g->n_params; i++) {
+			int k = param_kind(g->params[i][0], g->params[i][1]);
+			if (k != kind && (kind > 0 || k < 2)) {
+				g->params[n][0] = g->params[i][0];
+				g->params[n++][1] = g->params[i][1];
+			}
+		}
+		g->params[n][0] = nal;
+		g->params[n][1] = next;
+		g->n_params = n + 1;
+	}
+}
+
+/**
+ * Advance next_nal past one GOP and return the start code ending it. A GOP
+ * ends before the access unit of the next IDR picture, found from the NAL
+ * types starting an access unit (7.4.1.2.3) that precede its first slice
+ * (first_mb_in_slice=0). Parameter sets of the GOP are kept for replay, but not
+ * those of the access unit starting the next GOP, which decodes them itself.
+ */
+static const uint8_t *next_gop(Edge264Gops *g) {
+	const uint8_t *nal = g->next_nal, *au = NULL;
+	int has_slices = 0;
+	for (const uint8_t *next; nal < g->end; nal = next + 3) {
+		next = edge264_find_start_code(nal, g->end, 0);
+		int type = nal[0] & 0x1f;
+		if (0x100022 & 1 << type) { // 1, 5 or 20
+			if (type == 5 && has_slices && nal + 1 < next && nal[1] & 0x80) {
+				g->next_nal = au ?: nal;
+				return g->next_nal - 3;
+			}
+			if (au != NULL)
+				save_params(g, au, nal);
+			has_slices = 1;
+			au = NULL;
+		} else if (au == NULL && 0x7c3c0 & 1 << type) { // 6..9 or 14..18
+			au = nal;
+		}
+	}
+	g->next_nal = nal;
+	return g->end;
+}
+
+/**
+ * Wait until a GOP may output its frames, returning 0 if a GOP before it
+ * failed.
+ */
+static int wait_gop_turn(Edge264Gops *g, int gop) {
+	pthread_mutex_lock(&g->lock);
+	while (g->output_gop != gop && g->failed_gop > gop)
+		pthread_cond_wait(&g->turn_cond, &g->lock);
+	int turn = g->output_gop == gop;
+	pthread_mutex_unlock(&g->lock);
+	return turn;
+}
+
+// pass the frames ready in a decoder to output_cb, returning its first nonzero result
+static int output_gop_frames(Edge264Gops *g, Edge264Decoder *dec) {
+	Edge264Frame out;
+	int res = 0;
+	while (!res && !edge264_get_frame(dec, &out, 0))
+		res = g->output_cb(&out, g->output_arg);
+	return res;
+}
+
+/**
+ * Decode a GOP after replaying the parameter sets it may depend on, and return
+ * ENODATA once all of its frames were output. Frames are kept in the decoder
+ * until the GOP gets its turn, which stalls it once the DPB is full.
+ */
+static int decode_gop(Edge264Gops *g, Edge264Decoder *dec, int gop, const uint8_t *nal, const uint8_t *end, const uint8_t *params[6][2], int n_params) {
+	int ret, res;
+	for (int i = 0; i < n_params; i++) {
+		if ((ret = edge264_decode_NAL(dec, params[i][0], params[i][1], NULL, NULL)))
+			return ret;
+	}
+	do {
+		const uint8_t *next = edge264_find_start_code(nal, end, 0);
+		ret = edge264_decode_NAL(dec, nal, next, NULL, NULL);
+		if (__atomic_load_n(&g->failed_gop, __ATOMIC_ACQUIRE) < gop)
+			return ENODATA;
+		if ((ret == ENOBUFS ? wait_gop_turn(g, gop) : __atomic_load_n(&g->output_gop, __ATOMIC_ACQUIRE) == gop) &&
+		    (res = output_gop_frames(g, dec)))
+			return res;
+		if (ret != ENOBUFS)
+			nal = next + 3;
+	} while (ret == 0 || ret == ENOBUFS);
+	
+	// frames decoded before an error are still output in turn
+	if (ret != ENODATA && wait_gop_turn(g, gop) && (res = output_gop_frames(g, dec)))
+		return res;
+	return ret;
+}
+
+static void *gop_loop(void *arg) {
+	Edge264Gops *g = ((Edge264GopThread *)arg)->gops;
+	Edge264Decoder *dec = ((Edge264GopThread *)arg)->dec;
+	while (1) {
+		pthread_mutex_lock(&g->lock);
+		if (g->next_nal >= g->end || g->failed_gop < INT_MAX) {
+			pthread_mutex_unlock(&g->lock);
+			return NULL;
+		}
+		int gop = g->n_gops++;
+		const uint8_t *nal = g->next_nal;
+		const uint8_t *params[6][2];
+		int n_params = g->n_params;
+		memcpy(params, g->params, sizeof(params));
+		const uint8_t *end = next_gop(g);
+		pthread_mutex_unlock(&g->lock);
+		
+		// a GOP following a failed one ends without its turn and is not reported
+		int ret = decode_gop(g, dec, gop, nal, end, params, n_params);
+		if (wait_gop_turn(g, gop)) {
+			pthread_mutex_lock(&g->lock);
+			if (ret != ENODATA) {
+				__atomic_store_n(&g->failed_gop, gop, __ATOMIC_RELEASE);
+				g->failed_ret = ret;
+			} else {
+				__atomic_store_n(&g->output_gop, gop + 1, __ATOMIC_RELEASE);
+			}
+			pthread_cond_broadcast(&g->turn_cond);
+			pthread_mutex_unlock(&g->lock);
+		}
+		edge264_flush(dec);
+	}
+}
+
+int edge264_decode_gops(Edge264Pool *pool, int n_decoders, const uint8_t *buf, const uint8_t *end, int flags, Edge264OutputCb output_cb, void *output_arg) {
+	if (buf == NULL || end == NULL || output_cb == NULL)
+		return EINVAL;
+	Edge264Pool *own_pool = NULL;
+	if (pool == NULL && (pool = own_pool = edge264_pool_alloc(-1, NULL)) == NULL)
+		return ENOMEM;
+	const uint8_t *start = edge264_find_start_code(buf, end, 0);
+	Edge264Gops g = {
+		.pool = pool,
+		.flags = flags,
+		.output_cb = output_cb,
+		.output_arg = output_arg,
+		.next_nal = start < end ? start + 3 : end,
+		.end = end,
+		.failed_gop = INT_MAX,
+	};
+	n_decoders = min(n_decoders > 0 ? n_decoders : pool->n_threads, 64);
+	Edge264GopThread *threads = calloc(n_decoders, sizeof(*threads));
+	int ret = ENOMEM;
+	if (threads != NULL && pthread_mutex_init(&g.lock, NULL) == 0) {
+		if (pthread_cond_init(&g.turn_cond, NULL) == 0) {
+			// the calling thread decodes GOPs with the first decoder, and starts a thread for each other
+			int n = 0;
+			for (; n < n_decoders; n++) {
+				threads[n].gops = &g;
+				if ((threads[n].dec = edge264_alloc(0, NULL, NULL, flags, NULL, NULL, NULL)) == NULL ||
+				    edge264_pool_attach(pool, threads[n].dec) != 0 ||
+				    (n > 0 && pthread_create(&threads[n].thread, NULL, gop_loop, &threads[n]) != 0)) {
+					edge264_free(&threads[n].dec);
+					break;
+				}
+			}
+			if (n > 0) {
+				gop_loop(&threads[0]);
+				for (int i = 1; i < n; i++)
+					pthread_join(threads[i].thread, NULL);
+				ret = g.failed_gop < INT_MAX ? g.failed_ret : ENODATA;
+			}
+			for (int i = 0; i < n; i++)
+				edge264_free(&threads[i].dec);
+			pthread_cond_destroy(&g.turn_cond);
+		}
+		pthread_mutex_destroy(&g.lock);
+	}
+	free(threads);
+	edge264_pool_free(&own_pool);
+	return ret;
+}
+
+
+
 void edge264_flush(Edge264Decoder *dec) {
 	if (dec == NULL)
 		return;
-	if (dec->n_threads)
+	if (dec->n_threads) {
+		pthread_mutex_lock(&dec->parse_lock);
 		pthread_mutex_lock(&dec->lock);
+	}
 	flush_frames(dec);
 	clear_decoder(dec);
-	if (dec->n_threads)
+	if (dec->n_threads) {
 		pthread_mutex_unlock(&dec->lock);
+		pthread_mutex_unlock(&dec->parse_lock);
+	}
 }
 
 
@@ -276,17 +813,20 @@ void edge264_free(Edge264Decoder **pdec) {
 	if (pdec != NULL && (dec = *pdec) != NULL) {
 		*pdec = NULL;
 		if (dec->n_threads) {
-			for (int i = 0; i < dec->n_threads; i++)
-				pthread_cancel(dec->threads[i]);
-			pthread_mutex_destroy(&dec->lock);
-			pthread_cond_destroy(&dec->task_ready);
-			pthread_cond_destroy(&dec->task_progress);
-			pthread_cond_destroy(&dec->task_complete);
+			Edge264Pool *pool = dec->pool;
+			detach_pool(dec);
+			if (dec->own_pool)
+				edge264_pool_free(&pool);
 		}
 		for (int i = 0; i < 32; i++) {
 			if (dec->samples_buffers[i] != NULL)
 				dec->free_cb(dec->samples_buffers[i], dec->mb_buffers[i], dec->alloc_arg);
 		}
+		for (int i = 0; i < dec->n_spare_buffers; i++)
+			dec->free_cb(dec->spare_buffers[i].samples, dec->spare_buffers[i].mbs, dec->alloc_arg);
+		for (int i = 0; i < 64; i++)
+			free(dec->recon_rings[i]);
+		free(dec->mb_window_buffer);
 		free(dec);
 	}
 }
@@ -321,14 +861,18 @@ int edge264_decode_NAL(Edge264Decoder *dec, const uint8_t *buf, const uint8_t *e
 	// initial checks before parsing
 	if (dec == NULL || buf == NULL)
 		return EINVAL;
-	if (dec->n_threads)
+	if (dec->n_threads) {
+		pthread_mutex_lock(&dec->parse_lock);
 		pthread_mutex_lock(&dec->lock);
+	}
 	
 	// bump all frames at the end of buffer
 	if (__builtin_expect(buf >= end, 0)) {
 		int ret = bump_all_frames(dec);
-		if (dec->n_threads)
+		if (dec->n_threads) {
 			pthread_mutex_unlock(&dec->lock);
+			pthread_mutex_unlock(&dec->parse_lock);
+		}
 		return ret ?: ENODATA;
 	}
 	
@@ -355,13 +899,67 @@ int edge264_decode_NAL(Edge264Decoder *dec, const uint8_t *buf, const uint8_t *e
 	// on non-slice successful return we release the NAL buffer
 	if (unref_cb && ret == 0 && !(0x100022 & 1 << dec->nal_unit_type)) // 1, 5 or 20
 		unref_cb(ret, unref_arg);
-	if (dec->n_threads)
+	if (dec->n_threads) {
 		pthread_mutex_unlock(&dec->lock);
+		// rather than returning idle to a caller that will only poll for frames, help complete them
+		if (ret == ENOBUFS)
+			run_caller_task(dec);
+		pthread_mutex_unlock(&dec->parse_lock);
+	}
 	return ret;
 }
 
 
 
+/**
+ * Number of rows from the top of the cropped frame whose samples are final.
+ * Deblocking the mb row below a deblocked row may still change its last 3
+ * lines. Field mbs interleave their lines, and NV12 chroma is interleaved
+ * after deblocking, so their rows are final only once the whole frame is.
+ */
+static int final_rows(Edge264Decoder *dec, int pic) {
+	int next_deblock_addr = __atomic_load_n(&dec->next_deblock_addr[pic], __ATOMIC_ACQUIRE);
+	if (next_deblock_addr == INT_MAX)
+		return dec->out.height_Y;
+	if (!dec->sps.frame_mbs_only_flag || dec->out.interleaved_CbCr)
+		return 0;
+	int rows = next_deblock_addr / dec->sps.pic_width_in_mbs * 16 - 3 - dec->out.frame_crop_offsets[0];
+	return min(max(rows, 0), dec->out.height_Y);
+}
+
+/**
+ * Fill a frame structure with the samples of one or two views (pic1 < 0 if
+ * none).
+ */
+static void fill_frame(Edge264Decoder *dec, Edge264Frame *out, int pic0, int pic1) {
+	memcpy(out, &dec->out, sizeof(*out)); // GCC-14 crashes on dec->out = format
+	int top = dec->out.frame_crop_offsets[0];
+	int left = dec->out.frame_crop_offsets[3];
+	int offY = top * dec->out.stride_Y + (dec->out.bit_depth_Y == 8 ? left : left << 1);
+	int topC = dec->sps.chroma_format_idc == 3 ? top : top >> 1;
+	int leftC = dec->sps.chroma_format_idc == 1 ? left >> 1 : left;
+	int offC = dec->plane_size_Y + topC * dec->out.stride_C + (dec->out.bit_depth_C == 8 ? leftC : leftC << 1);
+	int offCr = dec->out.stride_C >> 1;
+	if (dec->out.interleaved_CbCr) {
+		offC += dec->plane_size_C + (dec->out.bit_depth_C == 8 ? leftC : leftC << 1);
+		offCr = dec->out.bit_depth_C == 8 ? 1 : 2;
+	}
+	out->samples[0] = dec->samples_buffers[pic0] + offY;
+	out->samples[1] = dec->samples_buffers[pic0] + offC;
+	out->samples[2] = dec->samples_buffers[pic0] + offC + offCr;
+	out->FrameId = dec->FrameIds[pic0];
+	out->return_arg = (void *)((uintptr_t)1 << pic0);
+	out->final_rows_Y = final_rows(dec, pic0);
+	if (pic1 >= 0) {
+		out->samples_mvc[0] = dec->samples_buffers[pic1] + offY;
+		out->samples_mvc[1] = dec->samples_buffers[pic1] + offC;
+		out->samples_mvc[2] = dec->samples_buffers[pic1] + offC + offCr;
+		out->FrameId_mvc = dec->FrameIds[pic1];
+		out->return_arg = (void *)((uintptr_t)1 << pic0 | (uintptr_t)1 << pic1);
+		out->final_rows_Y = min(out->final_rows_Y, final_rows(dec, pic1));
+	}
+}
+
 int edge264_get_frame(Edge264Decoder *dec, Edge264Frame *out, int borrow) {
 	if (dec == NULL || out == NULL)
 		return EINVAL;
@@ -369,34 +967,25 @@ int edge264_get_frame(Edge264Decoder *dec, Edge264Frame *out, int borrow) {
 		pthread_mutex_lock(&dec->lock);
 	int idx0 = __builtin_ctzg(movemask(dec->output_queue_v[0][0]) | movemask(dec->output_queue_v[0][1]) << 16, 32) - 1;
 	int idx1 = __builtin_ctzg(movemask(dec->output_queue_v[1][0]) | movemask(dec->output_queue_v[1][1]) << 16, 32) - 1;
-	int pic0, pic1, res = ENOMSG;
-	if (idx0 >= 0 && dec->next_deblock_addr[pic0 = dec->output_queue[0][idx0]] == INT_MAX &&
-		(dec->ssps.BitDepth_Y == 0 || (idx1 >= 0 && dec->next_deblock_addr[pic1 = dec->output_queue[1][idx1]] == INT_MAX))) {
+	int pic0, pic1 = -1, res = ENOMSG;
+	if (idx0 >= 0 && __atomic_load_n(&dec->next_deblock_addr[pic0 = dec->output_queue[0][idx0]], __ATOMIC_ACQUIRE) == INT_MAX &&
+		(dec->ssps.BitDepth_Y == 0 || (idx1 >= 0 && __atomic_load_n(&dec->next_deblock_addr[pic1 = dec->output_queue[1][idx1]], __ATOMIC_ACQUIRE) == INT_MAX))) {
 		dec->output_queue[0][idx0] = -1;
-		memcpy(out, &dec->out, sizeof(*out)); // GCC-14 crashes on dec->out = format
-		int top = dec->out.frame_crop_offsets[0];
-		int left = dec->out.frame_crop_offsets[3];
-		int offY = top * dec->out.stride_Y + (dec->out.bit_depth_Y == 8 ? left : left << 1);
-		int topC = dec->sps.chroma_format_idc == 3 ? top : top >> 1;
-		int leftC = dec->sps.chroma_format_idc == 1 ? left >> 1 : left;
-		int offC = dec->plane_size_Y + topC * dec->out.stride_C + (dec->out.bit_depth_C == 8 ? leftC : leftC << 1);
 		assert(dec->to_get_frames & dec->output_frames & 1 << pic0);
 		dec->to_get_frames &= ~(1 << pic0);
-		out->samples[0] = dec->samples_buffers[pic0] + offY;
-		out->samples[1] = dec->samples_buffers[pic0] + offC;
-		out->samples[2] = dec->samples_buffers[pic0] + offC + (dec->out.stride_C >> 1);
-		out->FrameId = dec->FrameIds[pic0];
-		out->return_arg = (void *)((uintptr_t)1 << pic0);
 		if (idx1 >= 0) {
 			dec->output_queue[1][idx1] = -1;
 			assert(dec->to_get_frames & dec->output_frames & 1 << pic1);
 			dec->to_get_frames ^= 1 << pic1;
-			out->samples_mvc[0] = dec->samples_buffers[pic1] + offY;
-			out->samples_mvc[1] = dec->samples_buffers[pic1] + offC;
-			out->samples_mvc[2] = dec->samples_buffers[pic1] + offC + (dec->out.stride_C >> 1);
-			out->FrameId_mvc = dec->FrameIds[pic1];
-			out->return_arg = (void *)((uintptr_t)1 << pic0 | (uintptr_t)1 << pic1);
 		}
+		
+		// a frame got before any thread signaled it is signaled now, then the next one if it is complete
+		uint8_t count = dec->output_count++;
+		if (dec->frame_cb != NULL && __atomic_compare_exchange_n(&dec->notified_frames, &count, count + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			dec->frame_cb(dec->frame_arg);
+		publish_output_heads(dec);
+		notify_frame_ready(dec);
+		fill_frame(dec, out, pic0, idx1 >= 0 ? pic1 : -1);
 		res = 0;
 		if (!borrow)
 			dec->output_frames &= ~(uintptr_t)out->return_arg;
@@ -408,6 +997,25 @@ int edge264_get_frame(Edge264Decoder *dec, Edge264Frame *out, int borrow) {
 
 
 
+int edge264_peek_frame(Edge264Decoder *dec, Edge264Frame *out) {
+	if (dec == NULL || out == NULL)
+		return EINVAL;
+	if (dec->n_threads)
+		pthread_mutex_lock(&dec->lock);
+	int idx0 = __builtin_ctzg(movemask(dec->output_queue_v[0][0]) | movemask(dec->output_queue_v[0][1]) << 16, 32) - 1;
+	int idx1 = __builtin_ctzg(movemask(dec->output_queue_v[1][0]) | movemask(dec->output_queue_v[1][1]) << 16, 32) - 1;
+	int res = ENOMSG;
+	if (idx0 >= 0 && (dec->ssps.BitDepth_Y == 0 || idx1 >= 0)) {
+		fill_frame(dec, out, dec->output_queue[0][idx0], idx1 >= 0 ? dec->output_queue[1][idx1] : -1);
+		res = 0;
+	}
+	if (dec->n_threads)
+		pthread_mutex_unlock(&dec->lock);
+	return res;
+}
+
+
+
 void edge264_return_frame(Edge264Decoder *dec, void *return_arg) {
 	if (dec != NULL)
 		dec->output_frames &= ~(size_t)return_arg;
@@ -415,6 +1023,23 @@ void edge264_return_frame(Edge264Decoder *dec, void *return_arg) {
 
 
 
+void edge264_get_buffer_stats(Edge264Decoder *dec, unsigned *allocs, unsigned *reuses, unsigned *spares) {
+	if (dec == NULL)
+		return;
+	if (dec->n_threads)
+		pthread_mutex_lock(&dec->lock);
+	if (allocs != NULL)
+		*allocs = dec->allocated_buffers;
+	if (reuses != NULL)
+		*reuses = dec->reused_buffers;
+	if (spares != NULL)
+		*spares = dec->n_spare_buffers;
+	if (dec->n_threads)
+		pthread_mutex_unlock(&dec->lock);
+}
+
+
+
 const int8_t cabac_context_init[4][1024][2] __attribute__((aligned(16))) = {{
 	{  20, -15}, {   2,  54}, {   3,  74}, {  20, -15}, {   2,  54}, {   3,  74},
 	{ -28, 127}, { -23, 104}, {  -6,  53}, {  -1,  54}, {   7,  51}, {   0,   0},
@@ -39,6 +39,7 @@
 static Edge264Decoder *dec;
 static int count_pass;
 static int count_frames;
+static int count_end_frames; // frames held until the end of stream
 static void (*log_tester)(const char *);
 
 static int flt(const struct dirent *a) {
@@ -65,6 +66,30 @@ static void finish_frame_post() {
 		"finish-frame: number of decoded frames (%d) differs from expected (12)\n",
 		count_frames);
 }
+static void low_latency_post() {
+	ASSERT(count_frames == 4 && count_end_frames == 0,
+		"low-latency: %d of %d decoded frames were held until the end of stream\n",
+		count_end_frames, count_frames);
+}
+
+static uint64_t hash_frame(const Edge264Frame *f) {
+	uint64_t h = 0xcbf29ce484222325; // FNV-1a
+	int step = 1 + f->interleaved_CbCr; // with EDGE264_NV12 Cb and Cr alternate in a single plane
+	for (int view = 0; view < 1 + (f->samples_mvc[0] != NULL); view++) {
+		const uint8_t * const *samples = view ? f->samples_mvc : f->samples;
+		for (int y = 0; y < f->height_Y; y++) {
+			for (int x = 0; x < f->width_Y; x++)
+				h = (h ^ samples[0][y * f->stride_Y + x]) * 0x100000001b3;
+		}
+		for (int i = 1; i < 3; i++) {
+			for (int y = 0; y < f->height_C; y++) {
+				for (int x = 0; x < f->width_C; x++)
+					h = (h ^ samples[i][y * f->stride_C + x * step]) * 0x100000001b3;
+			}
+		}
+	}
+	return h;
+}
 
 static void assert_block(const char *name, size_t pstride, const uint8_t *p, int w, int h, const uint8_t *q) {
 	int pass = 1;
@@ -90,8 +115,9 @@ static void parse_NALs(const char *name, const uint8_t *nal, const uint8_t *end,
 	nal += 3 + (nal[2] == 0); // skip the [0]001 delimiter
 	Edge264Frame out;
 	int res = 0;
-	count_frames = 0;
+	count_frames = count_end_frames = 0;
 	for (int i = 0; res != ENODATA; i++) {
+		int at_end = nal >= end;
 		const uint8_t *start_code = edge264_find_start_code(nal, end, 0);
 		res = edge264_decode_NAL(dec, nal, start_code, NULL, NULL);
 		if (res != ENOBUFS)
@@ -99,8 +125,10 @@ static void parse_NALs(const char *name, const uint8_t *nal, const uint8_t *end,
 		ASSERT(res == expect[i],
 			"%s: NAL at index %d returned %s where %s was expected\n",
 			name, i, ret_to_str(res), ret_to_str(expect[i]));
-		while (!edge264_get_frame(dec, &out, 0))
+		while (!edge264_get_frame(dec, &out, 0)) {
 			count_frames += 1;
+			count_end_frames += at_end;
+		}
 	}
 	if (post_test)
 		post_test();
@@ -360,47 +388,491 @@ static void test_inter_decoding() {
 
 
 
-static void test(const char *name, void (*log_test)(const char *), void (*post_test)(), const uint8_t *expect) {
-	log_tester = log_test;
-	printf("\e[A\e[K%d " GREEN "PASS" RESET " (%s)\n", count_pass, name);
-	
-	// open and memory map the input test file
+/**
+ * Memory-map a test stream from the tests directory.
+ */
+typedef struct {
+	const uint8_t *buf;
+	const uint8_t *end;
+	#ifdef _WIN32
+		HANDLE f, m;
+	#else
+		int fd;
+	#endif
+} TestFile;
+
+static void open_test_file(const char *name, TestFile *t) {
 	char file_name[strlen(name) + 11];
 	snprintf(file_name, sizeof(file_name), "tests/%s.264", name);
 	#ifdef _WIN32
-		HANDLE f = NULL, m = NULL;
 		void *v = NULL;
-		if ((f = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL)) == INVALID_HANDLE_VALUE ||
-			(m = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL)) == NULL ||
-			(v = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0)) == NULL) {
+		t->f = t->m = NULL;
+		if ((t->f = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL)) == INVALID_HANDLE_VALUE ||
+			(t->m = CreateFileMappingA(t->f, NULL, PAGE_READONLY, 0, 0, NULL)) == NULL ||
+			(v = MapViewOfFile(t->m, FILE_MAP_READ, 0, 0, 0)) == NULL) {
 			printf("Error opening file %s for input: %lu\n", file_name, GetLastError());
 			exit(1);
 		}
-		const uint8_t *nal = v;
-		const uint8_t *end = v + GetFileSize(f, NULL);
+		t->buf = v;
+		t->end = v + GetFileSize(t->f, NULL);
 	#else
-		int fd = -1;
 		struct stat st;
 		uint8_t *mm = MAP_FAILED;
-		PASSERT((fd = open(file_name, O_RDONLY)) >= 0 &&
-			!fstat(fd, &st) &&
-			(mm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED,
+		PASSERT((t->fd = open(file_name, O_RDONLY)) >= 0 &&
+			!fstat(t->fd, &st) &&
+			(mm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, t->fd, 0)) != MAP_FAILED,
 			file_name);
-		const uint8_t *nal = mm;
-		const uint8_t *end = mm + st.st_size;
+		t->buf = mm;
+		t->end = mm + st.st_size;
 	#endif
-	
-	parse_NALs(name, nal, end, post_test, expect);
-	
-	// close everything
+}
+
+static void close_test_file(TestFile *t) {
 	#ifdef _WIN32
-		UnmapViewOfFile(v);
-		CloseHandle(m);
-		CloseHandle(f);
+		UnmapViewOfFile(t->buf);
+		CloseHandle(t->m);
+		CloseHandle(t->f);
 	#else
-		PASSERT(!munmap(mm, st.st_size), NULL);
-		close(fd);
+		PASSERT(!munmap((void *)t->buf, t->end - t->buf), NULL);
+		close(t->fd);
 	#endif
+}
+
+
+
+static void test(const char *name, void (*log_test)(const char *), void (*post_test)(), const uint8_t *expect) {
+	log_tester = log_test;
+	printf("\e[A\e[K%d " GREEN "PASS" RESET " (%s)\n", count_pass, name);
+	TestFile t;
+	open_test_file(name, &t);
+	parse_NALs(name, t.buf, t.end, post_test, expect);
+	close_test_file(&t);
+	count_pass += 1;
+}
+
+
+
+/**
+ * Peek at frames of a stream output as soon as decoded, with three slices per
+ * frame, checking that the rows announced final do not change afterwards.
+ */
+static void test_peek_frame() {
+	printf("\e[A\e[K%d " GREEN "PASS" RESET " (peek-frame)\n", count_pass);
+	TestFile t;
+	open_test_file("peek-frame", &t);
+	Edge264Frame peek, out;
+	ASSERT(edge264_peek_frame(NULL, &peek) == EINVAL && edge264_peek_frame(dec, NULL) == EINVAL,
+		"peek-frame: NULL arguments were not rejected\n");
+	ASSERT(edge264_peek_frame(dec, &peek) == ENOMSG,
+		"peek-frame: a frame was peeked before decoding\n");
+	static const int16_t expect_rows[3] = {13, 29, 64};
+	uint8_t top[64 * 64];
+	int i = 0;
+	int32_t FrameId = 0;
+	for (const uint8_t *nal = t.buf + 3 + (t.buf[2] == 0), *next; nal < t.end; nal = next + 3) {
+		next = edge264_find_start_code(nal, t.end, 0);
+		ASSERT(edge264_decode_NAL(dec, nal, next, NULL, NULL) == 0,
+			"peek-frame: decoding NAL failed\n");
+		if (edge264_peek_frame(dec, &peek))
+			continue;
+		if (i % 3 == 0)
+			FrameId = peek.FrameId;
+		ASSERT(peek.FrameId == FrameId && peek.final_rows_Y == expect_rows[i % 3],
+			"peek-frame: slice %d of a frame has %d final rows where %d were expected\n",
+			i % 3, peek.final_rows_Y, expect_rows[i % 3]);
+		for (int y = 0; i % 3 && y < expect_rows[i % 3 - 1]; y++)
+			ASSERT(memcmp(top + y * 64, peek.samples[0] + y * peek.stride_Y, 64) == 0,
+				"peek-frame: final row %d of frame %d changed with its next slice\n", y, FrameId);
+		for (int y = 0; y < peek.final_rows_Y; y++)
+			memcpy(top + y * 64, peek.samples[0] + y * peek.stride_Y, 64);
+		if (++i % 3) {
+			ASSERT(edge264_get_frame(dec, &out, 0) == ENOMSG,
+				"peek-frame: edge264_get_frame returned frame %d before its last slice\n", FrameId);
+		} else {
+			ASSERT(edge264_get_frame(dec, &out, 0) == 0 && out.FrameId == FrameId && out.samples[0] == peek.samples[0],
+				"peek-frame: edge264_get_frame did not return the peeked frame %d\n", FrameId);
+			ASSERT(edge264_peek_frame(dec, &peek) == ENOMSG,
+				"peek-frame: frame %d could still be peeked after edge264_get_frame\n", FrameId);
+		}
+	}
+	ASSERT(i == 12, "peek-frame: %d slices were peeked where 12 were expected\n", i);
+	edge264_flush(dec);
+	close_test_file(&t);
+	count_pass += 1;
+}
+
+
+
+/**
+ * Decode the next NAL of a stream (or its end past the last NAL), and store the
+ * hashes of the frames output.
+ */
+static int decode_step(Edge264Decoder *d, const uint8_t **nal, const uint8_t *end, uint64_t *hashes, int *n_frames) {
+	const uint8_t *next = *nal < end ? edge264_find_start_code(*nal, end, 0) : end;
+	int res = edge264_decode_NAL(d, *nal, next, NULL, NULL);
+	if (res != ENOBUFS)
+		*nal = next + 3;
+	Edge264Frame out;
+	while (*n_frames < 32 && !edge264_get_frame(d, &out, 0))
+		hashes[(*n_frames)++] = hash_frame(&out);
+	return res;
+}
+
+static int decode_hashes(const char *name, Edge264Decoder *d, const TestFile *t, uint64_t *hashes) {
+	const uint8_t *nal = t->buf + 3 + (t->buf[2] == 0);
+	int res, n_frames = 0;
+	while ((res = decode_step(d, &nal, t->end, hashes, &n_frames)) == 0 || res == ENOBUFS);
+	ASSERT(res == ENODATA, "%s: decoding ended with %s where ENODATA was expected\n", name, ret_to_str(res));
+	return n_frames;
+}
+
+static void assert_hashes(const char *name, int n_frames, const uint64_t *hashes, int n_ref, const uint64_t *ref) {
+	ASSERT(n_frames == n_ref, "%s: number of decoded frames (%d) differs from expected (%d)\n", name, n_frames, n_ref);
+	for (int i = 0; i < n_frames; i++)
+		ASSERT(hashes[i] == ref[i], "%s: frame %d differs from single-threaded decoding\n", name, i);
+}
+
+static void count_unref(int ret, void *arg) {
+	__atomic_add_fetch((int *)arg, 1, __ATOMIC_RELAXED);
+}
+
+static void count_frame(void *arg) {
+	__atomic_add_fetch((int *)arg, 1, __ATOMIC_RELAXED);
+}
+
+
+
+/**
+ * Decode streams with workers, started by the decoder or shared in a pool,
+ * and compare the frames (both views for MVC) with those of single-threaded
+ * decoding.
+ */
+static void test_threads() {
+	printf("\e[A\e[K%d " GREEN "PASS" RESET " (threads)\n", count_pass);
+	TestFile t;
+	open_test_file("multi-frames", &t);
+	uint64_t ref[32], hashes[2][32];
+	int n_ref = decode_hashes("threads", dec, &t, ref);
+	edge264_flush(dec);
+	ASSERT(n_ref == 9, "threads: number of decoded frames (%d) differs from expected (9)\n", n_ref);
+	
+	// workers waiting on the rows of their references, with each scheduling option
+	static const struct { int n_threads, flags; const char *name; } configs[] = {
+		{2, 0, "workers"},
+		{3, 0, "workers"},
+		{2, EDGE264_FIFO_TASKS, "fifo-tasks"},
+		{2, EDGE264_DEBLOCK_STAGE, "deblock-stage"},
+		{2, EDGE264_RECON_STAGE, "recon-stage"},
+		{4, EDGE264_RECON_STAGE, "recon-wavefront"},
+	};
+	Edge264Decoder *d;
+	for (int i = 0; i < sizeof(configs) / sizeof(*configs); i++) {
+		d = edge264_alloc(configs[i].n_threads, NULL, NULL, configs[i].flags, NULL, NULL, NULL);
+		ASSERT(d != NULL, "threads: edge264_alloc failed\n");
+		assert_hashes(configs[i].name, decode_hashes(configs[i].name, d, &t, hashes[0]), hashes[0], n_ref, ref);
+		edge264_free(&d);
+	}
+	
+	// a decoder limited to a single worker, then back to automatic scaling
+	d = edge264_alloc(3, NULL, NULL, 0, NULL, NULL, NULL);
+	ASSERT(d != NULL, "threads: edge264_alloc failed\n");
+	edge264_set_max_workers(d, 1);
+	assert_hashes("max-workers", decode_hashes("max-workers", d, &t, hashes[0]), hashes[0], n_ref, ref);
+	edge264_flush(d);
+	edge264_set_max_workers(d, 0);
+	assert_hashes("max-workers", decode_hashes("max-workers", d, &t, hashes[0]), hashes[0], n_ref, ref);
+	edge264_free(&d);
+	
+	// the calling thread runs ready slices while waiting for workers
+	d = edge264_alloc(2, NULL, NULL, EDGE264_CALLER_TASKS, NULL, NULL, NULL);
+	ASSERT(d != NULL, "threads: edge264_alloc failed\n");
+	assert_hashes("caller-tasks", decode_hashes("caller-tasks", d, &t, hashes[0]), hashes[0], n_ref, ref);
+	edge264_free(&d);
+	
+	// frame_cb signals each frame once in output order, only the head of the queue being signaled ahead of edge264_get_frame
+	d = edge264_alloc(2, NULL, NULL, 0, NULL, NULL, NULL);
+	ASSERT(d != NULL, "threads: edge264_alloc failed\n");
+	int signaled = 0, n_got = 0, ret;
+	edge264_set_frame_cb(d, count_frame, &signaled);
+	const uint8_t *nal = t.buf + 3 + (t.buf[2] == 0);
+	do {
+		const uint8_t *next = nal < t.end ? edge264_find_start_code(nal, t.end, 0) : t.end;
+		ret = edge264_decode_NAL(d, nal, next, NULL, NULL);
+		if (ret != ENOBUFS)
+			nal = next + 3;
+		Edge264Frame out;
+		while (n_got < 32 && !edge264_get_frame(d, &out, 0)) {
+			hashes[0][n_got++] = hash_frame(&out);
+			int n = __atomic_load_n(&signaled, __ATOMIC_RELAXED);
+			ASSERT(n <= n_got + 1, "frame-cb: %d frames were signaled after getting %d\n", n, n_got);
+		}
+	} while (ret == 0 || ret == ENOBUFS);
+	assert_hashes("frame-cb", n_got, hashes[0], n_ref, ref);
+	edge264_free(&d);
+	ASSERT(signaled == n_ref, "frame-cb: %d frames were signaled where %d were expected\n", signaled, n_ref);
+	
+	// flushing mid-stream with workers running drops or interrupts slices, which are all signaled once to unref_cb
+	d = edge264_alloc(2, NULL, NULL, 0, NULL, NULL, NULL);
+	ASSERT(d != NULL, "threads: edge264_alloc failed\n");
+	nal = t.buf + 3 + (t.buf[2] == 0);
+	int accepted = 0, unrefs = 0;
+	for (int i = 0; i < 20 && nal < t.end; ) {
+		const uint8_t *next = edge264_find_start_code(nal, t.end, 0);
+		ret = edge264_decode_NAL(d, nal, next, count_unref, &unrefs);
+		if (ret == ENOBUFS) {
+			Edge264Frame out;
+			while (!edge264_get_frame(d, &out, 0));
+			continue;
+		}
+		accepted += ret == 0;
+		nal = next + 3;
+		i++;
+	}
+	edge264_flush(d);
+	ASSERT(__atomic_load_n(&unrefs, __ATOMIC_RELAXED) == accepted,
+		"flush: unref_cb was called %d times for %d NALs accepted\n", unrefs, accepted);
+	assert_hashes("flush", decode_hashes("flush", d, &t, hashes[0]), hashes[0], n_ref, ref);
+	edge264_free(&d);
+	
+	// two decoders sharing a pool, decoding in alternation, one limited to a single worker, with idle workers polling before they park
+	Edge264Pool *pool = edge264_pool_alloc(3, NULL);
+	Edge264Decoder *ds[2] = {
+		edge264_alloc(0, NULL, NULL, EDGE264_FIFO_TASKS, NULL, NULL, NULL),
+		edge264_alloc(0, NULL, NULL, EDGE264_DEBLOCK_STAGE | EDGE264_RECON_STAGE, NULL, NULL, NULL)};
+	ASSERT(pool != NULL && ds[0] != NULL && ds[1] != NULL && edge264_pool_alloc(0, NULL) == NULL,
+		"threads: edge264_pool_alloc or edge264_alloc failed\n");
+	ASSERT(edge264_pool_attach(pool, ds[0]) == 0 && edge264_pool_attach(pool, ds[1]) == 0,
+		"threads: edge264_pool_attach failed\n");
+	ASSERT(edge264_pool_attach(pool, ds[0]) == EINVAL && edge264_pool_attach(NULL, ds[1]) == EINVAL && edge264_pool_attach(pool, NULL) == EINVAL,
+		"threads: edge264_pool_attach accepted invalid arguments\n");
+	edge264_set_max_workers(ds[1], 1);
+	edge264_pool_set_spin(pool, 100);
+	const uint8_t *nals[2] = {t.buf + 3 + (t.buf[2] == 0), t.buf + 3 + (t.buf[2] == 0)};
+	int res[2] = {}, n_frames[2] = {};
+	while (res[0] != ENODATA || res[1] != ENODATA) {
+		for (int i = 0; i < 2; i++) {
+			if (res[i] != ENODATA) {
+				res[i] = decode_step(ds[i], &nals[i], t.end, hashes[i], &n_frames[i]);
+				ASSERT(res[i] == 0 || res[i] == ENOBUFS || res[i] == ENODATA,
+					"pool: decoder %d returned %s\n", i, ret_to_str(res[i]));
+			}
+		}
+	}
+	assert_hashes("pool", n_frames[0], hashes[0], n_ref, ref);
+	assert_hashes("pool", n_frames[1], hashes[1], n_ref, ref);
+	edge264_free(&ds[0]);
+	edge264_free(&ds[1]);
+	edge264_pool_free(&pool);
+	ASSERT(pool == NULL, "threads: edge264_pool_free did not unset the pointer\n");
+	close_test_file(&t);
+	
+	// both views of MVC access units, the non-base view waiting on the rows of its base view
+	open_test_file("supp-nals", &t);
+	n_ref = decode_hashes("mvc", dec, &t, ref);
+	edge264_flush(dec);
+	ASSERT(n_ref == 2, "mvc: number of decoded frames (%d) differs from expected (2)\n", n_ref);
+	for (int max_workers = 0; max_workers < 3; max_workers += 2) {
+		d = edge264_alloc(2, NULL, NULL, 0, NULL, NULL, NULL);
+		ASSERT(d != NULL, "threads: edge264_alloc failed\n");
+		edge264_set_max_workers(d, max_workers);
+		assert_hashes("mvc", decode_hashes("mvc", d, &t, hashes[0]), hashes[0], n_ref, ref);
+		edge264_free(&d);
+	}
+	close_test_file(&t);
+	count_pass += 1;
+}
+
+
+
+/**
+ * Decode slices sent out of order with disable_deblocking_filter_idc 2, which
+ * workers complete in any order and merge in the deblocking progress of their
+ * frames, and compare with single-threaded decoding.
+ */
+static void test_deblock_order() {
+	printf("\e[A\e[K%d " GREEN "PASS" RESET " (deblock-order)\n", count_pass);
+	TestFile t;
+	open_test_file("deblock-order", &t);
+	uint64_t ref[32], hashes[32];
+	int n_ref = decode_hashes("deblock-order", dec, &t, ref);
+	edge264_flush(dec);
+	ASSERT(n_ref == 6, "deblock-order: number of decoded frames (%d) differs from expected (6)\n", n_ref);
+	static const int flags[2] = {0, EDGE264_DEBLOCK_STAGE};
+	for (int i = 0; i < 2; i++) {
+		Edge264Decoder *d = edge264_alloc(3, NULL, NULL, flags[i], NULL, NULL, NULL);
+		ASSERT(d != NULL, "deblock-order: edge264_alloc failed\n");
+		assert_hashes("deblock-order", decode_hashes("deblock-order", d, &t, hashes), hashes, n_ref, ref);
+		edge264_free(&d);
+	}
+	close_test_file(&t);
+	count_pass += 1;
+}
+
+
+
+/**
+ * Decode a stream changing frame size, and check the counts of buffers after
+ * each SPS. Frames too small for the next size are freed, larger ones are kept
+ * as spares and reused, and spares left unused during a whole size are freed.
+ */
+static void test_buffer_stats() {
+	printf("\e[A\e[K%d " GREEN "PASS" RESET " (resolution-change)\n", count_pass);
+	TestFile t;
+	open_test_file("resolution-change", &t);
+	Edge264Decoder *d = edge264_alloc(0, NULL, NULL, 0, NULL, NULL, NULL);
+	ASSERT(d != NULL, "resolution-change: edge264_alloc failed\n");
+	static const unsigned expect[5][3] = {{0, 0, 0}, {3, 0, 0}, {6, 0, 3}, {6, 1, 1}, {8, 2, 0}}; // {allocs, reuses, spares}
+	unsigned stats[3];
+	uint64_t hashes[32];
+	int res, n_frames = 0, n_stats = 0;
+	const uint8_t *nal = t.buf + 3 + (t.buf[2] == 0);
+	do {
+		int nal_unit_type = nal < t.end ? nal[0] & 0x1f : 0;
+		res = decode_step(d, &nal, t.end, hashes, &n_frames);
+		if (res == ENODATA || (nal_unit_type == 7 && res == 0)) {
+			edge264_get_buffer_stats(d, &stats[0], &stats[1], &stats[2]);
+			ASSERT(n_stats < 5 && memcmp(stats, expect[n_stats], sizeof(stats)) == 0,
+				"resolution-change: buffer stats %d are {%u, %u, %u} where {%u, %u, %u} were expected\n",
+				n_stats, stats[0], stats[1], stats[2], expect[n_stats][0], expect[n_stats][1], expect[n_stats][2]);
+			n_stats++;
+		}
+	} while (res == 0 || res == ENOBUFS);
+	ASSERT(res == ENODATA && n_stats == 5 && n_frames == 10,
+		"resolution-change: decoding returned %s after %d frames where ENODATA was expected after 10\n",
+		ret_to_str(res), n_frames);
+	edge264_get_buffer_stats(d, NULL, NULL, NULL);
+	edge264_free(&d);
+	close_test_file(&t);
+	count_pass += 1;
+}
+
+
+
+/**
+ * Decode a stream with EDGE264_NV12, single-threaded then with workers, and
+ * compare its frames with planar output.
+ */
+static void test_nv12() {
+	printf("\e[A\e[K%d " GREEN "PASS" RESET " (nv12)\n", count_pass);
+	TestFile t;
+	open_test_file("multi-frames", &t);
+	uint64_t ref[32], hashes[32];
+	int n_ref = decode_hashes("nv12", dec, &t, ref);
+	edge264_flush(dec);
+	for (int n_threads = 0; n_threads <= 2; n_threads += 2) {
+		Edge264Decoder *d = edge264_alloc(n_threads, NULL, NULL, EDGE264_NV12, NULL, NULL, NULL);
+		ASSERT(d != NULL, "nv12: edge264_alloc failed\n");
+		assert_hashes("nv12", decode_hashes("nv12", d, &t, hashes), hashes, n_ref, ref);
+		edge264_free(&d);
+	}
+	close_test_file(&t);
+	count_pass += 1;
+}
+
+
+
+/**
+ * Decode frames large enough to be aligned to huge pages with
+ * EDGE264_HUGE_PAGES, single-threaded then with workers, and compare them with
+ * plain allocations.
+ */
+static void test_huge_pages() {
+	printf("\e[A\e[K%d " GREEN "PASS" RESET " (huge-pages)\n", count_pass);
+	TestFile t;
+	open_test_file("huge-pages", &t);
+	uint64_t ref[32], hashes[32];
+	int n_ref = decode_hashes("huge-pages", dec, &t, ref);
+	edge264_flush(dec);
+	ASSERT(n_ref == 3, "huge-pages: number of decoded frames (%d) differs from expected (3)\n", n_ref);
+	for (int n_threads = 0; n_threads <= 2; n_threads += 2) {
+		Edge264Decoder *d = edge264_alloc(n_threads, NULL, NULL, EDGE264_HUGE_PAGES, NULL, NULL, NULL);
+		ASSERT(d != NULL, "huge-pages: edge264_alloc failed\n");
+		assert_hashes("huge-pages", decode_hashes("huge-pages", d, &t, hashes), hashes, n_ref, ref);
+		edge264_free(&d);
+	}
+	close_test_file(&t);
+	count_pass += 1;
+}
+
+
+
+/**
+ * Decode non-reference pictures with EDGE264_MB_WINDOW, including slices that
+ * do not continue the previous one and move their picture to a whole frame of
+ * mbs, and compare its frames with plain decoding.
+ */
+static void test_mb_window() {
+	printf("\e[A\e[K%d " GREEN "PASS" RESET " (mb-window)\n", count_pass);
+	TestFile t;
+	open_test_file("mb-window", &t);
+	uint64_t ref[32], hashes[32];
+	int n_ref = decode_hashes("mb-window", dec, &t, ref);
+	edge264_flush(dec);
+	ASSERT(n_ref == 7, "mb-window: number of decoded frames (%d) differs from expected (7)\n", n_ref);
+	Edge264Decoder *d = edge264_alloc(0, NULL, NULL, EDGE264_MB_WINDOW, NULL, NULL, NULL);
+	ASSERT(d != NULL, "mb-window: edge264_alloc failed\n");
+	assert_hashes("mb-window", decode_hashes("mb-window", d, &t, hashes), hashes, n_ref, ref);
+	edge264_free(&d);
+	close_test_file(&t);
+	count_pass += 1;
+}
+
+
+
+typedef struct {
+	int n_frames;
+	int stop_at; // number of frames after which output_cb stops decoding
+	uint64_t hashes[32];
+} GopsOutput;
+
+static int gops_output(const Edge264Frame *frame, void *arg) {
+	GopsOutput *o = arg;
+	if (o->n_frames < 32)
+		o->hashes[o->n_frames] = hash_frame(frame);
+	return ++o->n_frames == o->stop_at ? ECANCELED : 0;
+}
+
+/**
+ * Decode streams split into GOPs, and compare with sequential decoding. The
+ * test stream has IDR pictures of two slices, an access unit delimiter before
+ * an IDR picture, and parameter sets between GOPs that must be replayed.
+ */
+static void test_gops() {
+	printf("\e[A\e[K%d " GREEN "PASS" RESET " (gops)\n", count_pass);
+	TestFile t;
+	open_test_file("gops", &t);
+	uint64_t ref[32];
+	int n_ref = decode_hashes("gops", dec, &t, ref);
+	edge264_flush(dec);
+	ASSERT(n_ref == 21, "gops: number of decoded frames (%d) differs from expected (21)\n", n_ref);
+	Edge264Pool *pool = edge264_pool_alloc(2, NULL);
+	ASSERT(pool != NULL, "gops: edge264_pool_alloc failed\n");
+	for (int n_decoders = 1; n_decoders <= 3; n_decoders += 2) {
+		GopsOutput o = {};
+		int res = edge264_decode_gops(pool, n_decoders, t.buf, t.end, 0, gops_output, &o);
+		ASSERT(res == ENODATA, "gops: decoding returned %s where ENODATA was expected\n", ret_to_str(res));
+		assert_hashes("gops", o.n_frames, o.hashes, n_ref, ref);
+	}
+	
+	// output_cb stops decoding with its return code
+	GopsOutput o = {.stop_at = 7};
+	int res = edge264_decode_gops(pool, 3, t.buf, t.end, 0, gops_output, &o);
+	ASSERT(res == ECANCELED && o.n_frames == 7,
+		"gops: stopping at frame 7 returned %s after %d frames\n", ret_to_str(res), o.n_frames);
+	ASSERT(edge264_decode_gops(pool, 0, NULL, t.end, 0, gops_output, &o) == EINVAL &&
+		edge264_decode_gops(pool, 0, t.buf, t.end, 0, NULL, NULL) == EINVAL,
+		"gops: NULL arguments were not rejected\n");
+	close_test_file(&t);
+	
+	// the second GOP fails on its cropping leaving no sample, as with sequential decoding
+	open_test_file("zero-cropping", &t);
+	o = (GopsOutput){};
+	res = edge264_decode_gops(pool, 2, t.buf, t.end, 0, gops_output, &o);
+	ASSERT(res == EBADMSG && o.n_frames == 1,
+		"zero-cropping: GOP decoding returned %s after %d frames where EBADMSG was expected after 1\n",
+		ret_to_str(res), o.n_frames);
+	close_test_file(&t);
+	edge264_pool_free(&pool);
 	count_pass += 1;
 }
 
@@ -442,6 +914,15 @@ int main(int argc, char *argv[]) {
 	test("max-logs", max_logs_logger, NULL, (uint8_t[]){0, ENODATA});
 	test("finish-frame", NULL, finish_frame_post, (uint8_t[]){0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, ENOBUFS, ENODATA});
 	test("nal-ref-idc-0", NULL, NULL, (uint8_t[]){0, 0, 0, 0, 0, 0, 0, 0, ENOBUFS, 0, 0, ENODATA});
+	test("low-latency", NULL, low_latency_post, (uint8_t[]){0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, ENODATA});
+	test_peek_frame();
+	test_threads();
+	test_deblock_order();
+	test_nv12();
+	test_huge_pages();
+	test_mb_window();
+	test_gops();
+	test_buffer_stats();
 	test_page_boundaries();
 	test_intra_decoding();
 	test_inter_decoding();
@@ -91,32 +91,226 @@ static int bump_frame(Edge264Decoder *dec, int non_base_view, unsigned ignored)
 	i8x16 *queue = dec->output_queue_v[non_base_view];
 	queue[1] = shrd128(queue[0], queue[1], 15);
 	queue[0] = shrd128(set8(pic), queue[0], 15);
+	publish_output_heads(dec);
+	notify_frame_ready(dec);
 	return 1;
 }
 
+/**
+ * With EDGE264_CALLER_TASKS, the thread calling the API runs a ready task of
+ * its decoder rather than waiting idle for workers. The task is claimed like
+ * workers do. Returns 0 if no task was ready.
+ */
+static int run_caller_task(Edge264Decoder *dec) {
+	if (!dec->caller_tasks || !dec->n_threads)
+		return 0;
+	int task_id = claim_task(dec, 0);
+	if (task_id < 0)
+		return 0;
+	dec->run_task(dec, task_id, dec->pool->n_threads); // a thread_id after workers, to wait on and signal them like they do
+	return 1;
+}
+
+/**
+ * Called by the parser to wait until workers release tasks, running a ready
+ * task meanwhile with EDGE264_CALLER_TASKS. dec->lock is released during the
+ * wait so that other threads may get frames, while dec->parse_lock still
+ * excludes other calls that would modify the decoder state.
+ */
+static void wait_task_releases(Edge264Decoder *dec, uint32_t seq) {
+	pthread_mutex_unlock(&dec->lock);
+	if (!run_caller_task(dec))
+		park(dec->pool, &dec->task_releases, seq);
+	pthread_mutex_lock(&dec->lock);
+}
+
 static int bump_all_frames(Edge264Decoder *dec) {
 	if (dec->currPic >= 0)
 		unset_currPic(dec);
 	while (bump_frame(dec, 0, 0) | bump_frame(dec, 1, 0));
-	while (dec->busy_tasks)
-		pthread_cond_wait(&dec->task_complete, &dec->lock);
+	for (uint32_t seq; seq = __atomic_load_n(&dec->task_releases, __ATOMIC_ACQUIRE), __atomic_load_n(&dec->busy_tasks, __ATOMIC_ACQUIRE); )
+		wait_task_releases(dec, seq);
 	return dec->to_get_frames | dec->output_frames ? ENOBUFS : 0;
 }
 
+/**
+ * Release the slots of a group of tasks and their references, then wake up
+ * the parser if it waits for them.
+ */
+static void release_tasks(Edge264Decoder *dec, uint64_t tasks, int thread_id) {
+	for (uint64_t t = tasks; t; t &= t - 1) {
+		__atomic_store_n(&dec->task_dependencies[__builtin_ctzll(t)], 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&dec->taskPics[__builtin_ctzll(t)], -1, __ATOMIC_RELAXED);
+	}
+	__atomic_and_fetch(&dec->busy_tasks, ~tasks, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&dec->task_releases, 1, __ATOMIC_RELEASE);
+	if (thread_id >= 0)
+		unpark(dec->pool, &dec->task_releases);
+}
+
+/**
+ * Take back the tasks that no worker started yet, and release them as if
+ * their slices were truncated before their first row. Tasks of a stage are
+ * left to the running slice that made them pending, as their group counts
+ * them until they exit.
+ */
+static void drop_pending_tasks(Edge264Decoder *dec) {
+	uint64_t pending = __atomic_load_n(&dec->pending_tasks, __ATOMIC_ACQUIRE);
+	uint64_t dropped;
+	do
+		dropped = pending & ~stage_tasks(dec, pending);
+	while (dropped && !__atomic_compare_exchange_n(&dec->pending_tasks, &pending, pending & ~dropped, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	uint64_t released = dropped;
+	for (uint64_t d = dropped; d; d &= d - 1) {
+		Edge264Task *t = dec->tasks + __builtin_ctzll(d);
+		if (t->unref_cb)
+			t->unref_cb(EBADMSG, t->unref_arg);
+		if (t->stage_task >= 0)
+			released |= dec->stage_groups[t->stage_task]; // not pending before their slice starts
+	}
+	if (released)
+		release_tasks(dec, released, -1);
+}
+
+/**
+ * Drop the tasks not started yet, interrupt the others at their next row of
+ * macroblocks, then wait until they are back to wait. Frames are marked
+ * complete to release any task waiting on a reference that will never finish.
+ */
 static void flush_frames(Edge264Decoder *dec) {
-	// FIXME interrupt all threads then wait until they are back to wait
 	assert(!(dec->n_threads == 0 && dec->busy_tasks));
-	while (dec->busy_tasks)
-		pthread_cond_wait(&dec->task_complete, &dec->lock);
+	__atomic_store_n(&dec->cancel_tasks, 1, __ATOMIC_RELEASE);
+	drop_pending_tasks(dec);
+	for (uint32_t seq; seq = __atomic_load_n(&dec->task_releases, __ATOMIC_ACQUIRE), __atomic_load_n(&dec->busy_tasks, __ATOMIC_ACQUIRE); ) {
+		for (int i = 0; i < 32; i++) {
+			__atomic_store_n(&dec->next_deblock_addr[i], INT_MAX, __ATOMIC_RELEASE);
+			unpark(dec->pool, &dec->next_deblock_addr[i]);
+		}
+		wait_task_releases(dec, seq);
+	}
+	__atomic_store_n(&dec->cancel_tasks, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Round an allocation up to a multiple of 1/8 of its highest power of two,
+ * such that close resolutions (ex. with different cropping) share buffers.
+ */
+static unsigned size_class(unsigned size) {
+	unsigned step = max(1u << (WORD_BIT - 1 - __builtin_clz(size | 1)) >> 3, 64);
+	return (size + step - 1) & -step;
+}
+
+/**
+ * Keep the buffers of a frame as spare for a later frame they fit. If all
+ * spare slots are taken, the smallest buffers are freed.
+ */
+static void spare_frame(Edge264Decoder *dec, int id) {
+	Edge264Buffer b = {dec->samples_buffers[id], dec->mb_buffers[id], dec->samples_sizes[id], dec->mb_sizes[id]};
+	dec->samples_buffers[id] = NULL;
+	dec->mb_buffers[id] = NULL;
+	if (dec->n_spare_buffers == 32) {
+		int smallest = 0;
+		for (int i = 1; i < 32; i++) {
+			if (dec->spare_buffers[i].samples_size < dec->spare_buffers[smallest].samples_size)
+				smallest = i;
+		}
+		Edge264Buffer *s = &dec->spare_buffers[smallest];
+		if (s->samples_size >= b.samples_size) {
+			dec->free_cb(b.samples, b.mbs, dec->alloc_arg);
+			return;
+		}
+		dec->free_cb(s->samples, s->mbs, dec->alloc_arg);
+		*s = dec->spare_buffers[--dec->n_spare_buffers];
+	}
+	dec->spare_buffers[dec->n_spare_buffers++] = b;
+}
+
+/**
+ * When the workers of the pool are restricted to CPUs of a single NUMA node,
+ * prefer this node for the pages of a frame, and move those already placed
+ * elsewhere. Otherwise the thread allocating frames would place their mbs,
+ * which it initializes, and reused buffers would keep their previous pages.
+ */
+static void bind_frame(Edge264Decoder *dec, int id) {
+	#if defined(__linux__) && defined(SYS_mbind)
+		if (!dec->internal_alloc || dec->pool == NULL || dec->pool->numa_node < 0)
+			return;
+		unsigned long nodes[4] = {};
+		nodes[dec->pool->numa_node / LONG_BIT] = 1ul << dec->pool->numa_node % LONG_BIT;
+		uintptr_t page = sysconf(_SC_PAGESIZE);
+		uintptr_t start = (uintptr_t)dec->samples_buffers[id] & -page;
+		uintptr_t end = ((uintptr_t)dec->mb_buffers[id] + dec->mb_sizes[id] + page - 1) & -page; // internal_alloc places mbs after samples
+		syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, nodes, sizeof(nodes) * CHAR_BIT, MPOL_MF_MOVE);
+	#endif
 }
 
-static int alloc_frame(Edge264Decoder *dec, int id, int errno_on_fail) {
-	int mbs = (dec->sps.pic_width_in_mbs + 1) * dec->sps.pic_height_in_mbs - 1;
-	unsigned samples_size = dec->plane_size_Y + dec->plane_size_C + 16; // plus margin for overreads
-	unsigned mbs_size = sizeof(Edge264Macroblock) * mbs;
-	dec->alloc_cb((void **)&dec->samples_buffers[id], samples_size, (void **)&dec->mb_buffers[id], mbs_size, errno_on_fail, dec->alloc_arg);
+// bytes of samples allocated with a frame, including the interleaved chroma with EDGE264_NV12
+static unsigned frame_samples_size(Edge264Decoder *dec) {
+	return dec->plane_size_Y + (dec->plane_size_C << dec->out.interleaved_CbCr) + 16; // plus margin for overreads
+}
+
+// bytes of mbs and motion field allocated with a frame, none for frames decoded in mb_window_buffer
+static unsigned frame_mbs_size(const Edge264SeqParameterSet *sps, int window) {
+	int mbs = window ? 0 : (sps->pic_width_in_mbs + 1) * sps->pic_height_in_mbs - 1;
+	return sizeof(Edge264Macroblock) * mbs + (sps->direct_8x8_inference_flag ?
+		sizeof(Edge264MbMotion) * mbs + 64 : 0); // the motion field is only read with direct_8x8_inference_flag, plus its alignment
+}
+
+/**
+ * On a change of frame format, free the spares left from the previous one,
+ * since no frame reused them during a whole format, then keep the buffers of
+ * the previous format that fit frames of the new one. Spares thus never hold
+ * more memory than the frames of a single format.
+ */
+static void spare_frames(Edge264Decoder *dec, const Edge264SeqParameterSet *sps) {
+	for (int i = 0; i < dec->n_spare_buffers; i++)
+		dec->free_cb(dec->spare_buffers[i].samples, dec->spare_buffers[i].mbs, dec->alloc_arg);
+	dec->n_spare_buffers = 0;
+	unsigned samples_size = frame_samples_size(dec);
+	unsigned mbs_size = frame_mbs_size(sps, dec->mb_window && !dec->n_threads);
+	for (int i = 0; i < 32; i++) {
+		if (dec->samples_buffers[i] == NULL)
+			continue;
+		if (dec->samples_sizes[i] >= samples_size && dec->mb_sizes[i] >= mbs_size) {
+			spare_frame(dec, i);
+		} else {
+			dec->free_cb(dec->samples_buffers[i], dec->mb_buffers[i], dec->alloc_arg);
+			dec->samples_buffers[i] = NULL;
+			dec->mb_buffers[i] = NULL;
+		}
+	}
+}
+
+static int alloc_frame(Edge264Decoder *dec, int id, int window, int errno_on_fail) {
+	int mbs = window ? 0 : (dec->sps.pic_width_in_mbs + 1) * dec->sps.pic_height_in_mbs - 1;
+	unsigned samples_size = frame_samples_size(dec);
+	unsigned mbs_size = frame_mbs_size(&dec->sps, window);
+	
+	// take the smallest spare buffers that fit, otherwise allocate new ones
+	int spare = -1;
+	for (int i = 0; i < dec->n_spare_buffers; i++) {
+		Edge264Buffer *b = &dec->spare_buffers[i];
+		if (b->samples_size >= samples_size && b->mbs_size >= mbs_size &&
+		    (spare < 0 || b->samples_size < dec->spare_buffers[spare].samples_size))
+			spare = i;
+	}
+	if (spare >= 0) {
+		Edge264Buffer *b = &dec->spare_buffers[spare];
+		dec->samples_buffers[id] = b->samples;
+		dec->mb_buffers[id] = b->mbs;
+		dec->samples_sizes[id] = b->samples_size;
+		dec->mb_sizes[id] = b->mbs_size;
+		*b = dec->spare_buffers[--dec->n_spare_buffers];
+		dec->reused_buffers++;
+	} else {
+		dec->samples_sizes[id] = size_class(samples_size);
+		dec->mb_sizes[id] = size_class(mbs_size);
+		dec->alloc_cb((void **)&dec->samples_buffers[id], dec->samples_sizes[id], (void **)&dec->mb_buffers[id], dec->mb_sizes[id], errno_on_fail, dec->alloc_arg);
+		dec->allocated_buffers += dec->samples_buffers[id] && dec->mb_buffers[id];
+	}
 	Edge264Macroblock *m = dec->mb_buffers[id];
 	if (dec->samples_buffers[id] && m) {
+		bind_frame(dec, id);
 		for (int i = 0; i < mbs; i += dec->sps.pic_width_in_mbs + 1) {
 			for (int j = i; j < i + dec->sps.pic_width_in_mbs; j++)
 				m[j].recovery_bits = 0;
@@ -132,11 +326,87 @@ static int alloc_frame(Edge264Decoder *dec, int id, int errno_on_fail) {
 	}
 }
 
+/**
+ * Make sure a slot has buffers for the upcoming frame. With EDGE264_MB_WINDOW,
+ * slots of frames decoded in mb_window_buffer may lack mbs, in which case
+ * their buffers are kept as spare for a later such frame.
+ */
+static int claim_frame(Edge264Decoder *dec, int id, int window, int errno_on_fail) {
+	if (dec->samples_buffers[id] != NULL) {
+		if (dec->mb_sizes[id] >= frame_mbs_size(&dec->sps, window))
+			return 0;
+		spare_frame(dec, id);
+	}
+	return alloc_frame(dec, id, window, errno_on_fail);
+}
+
+/**
+ * Make sure mb_window_buffer fits the picture width, with an unavailable mb at
+ * the end of each row as in frames. The buffer is kept across pictures.
+ */
+static int alloc_mb_window(Edge264Decoder *dec, int width) {
+	int size = (width + 1) * MB_WINDOW_ROWS;
+	if (dec->mb_window_size < size) {
+		free(dec->mb_window_buffer);
+		dec->mb_window_size = 0;
+		if ((dec->mb_window_buffer = aligned_alloc(16, size * sizeof(Edge264Macroblock))) == NULL)
+			return ENOMEM;
+		dec->mb_window_size = size;
+	}
+	for (int i = width; i < size; i += width + 1)
+		dec->mb_window_buffer[i] = unavail_mb;
+	return 0;
+}
+
+/**
+ * When a slice does not continue the previous one in a window of mb rows, the
+ * picture falls back to a whole frame of mbs in mb_window_buffer. The two rows
+ * around the end of decoded mbs, needed to deblock the next slices, move to
+ * their place in the frame, and all mbs before this end are marked decoded.
+ */
+static int spill_mb_window(Edge264Decoder *dec, int currPic) {
+	int width = dec->sps.pic_width_in_mbs;
+	int height = dec->sps.pic_height_in_mbs;
+	int stride = width + 1;
+	int end = min(dec->next_deblock_addr[currPic], width * height);
+	int last = min(end / width, height - 1); // last row started in the window
+	Edge264Macroblock *m = dec->mb_window_buffer;
+	if (dec->mb_window_size < stride * height &&
+	    (m = aligned_alloc(16, stride * height * sizeof(Edge264Macroblock))) == NULL)
+		return ENOMEM;
+	for (int y = last; y >= max(last - 1, 0); y--) // from the bottom since rows only move down
+		memmove(m + y * stride, dec->mb_window_buffer + (window_row(last) - last + y) * stride, width * sizeof(Edge264Macroblock));
+	if (m != dec->mb_window_buffer) {
+		free(dec->mb_window_buffer);
+		dec->mb_window_buffer = m;
+		dec->mb_window_size = stride * height;
+	}
+	int flip_bit = dec->frame_flip_bits >> currPic & 1;
+	for (int i = 0; i < width * height; i++)
+		m[i + i / width].recovery_bits = i < end ? (m[i + i / width].recovery_bits & 2) | flip_bit : flip_bit ^ 1;
+	for (int i = width; i < stride * height; i += stride)
+		m[i] = unavail_mb;
+	dec->window_frames &= ~(1 << currPic);
+	dec->spilled_frames |= 1 << currPic;
+	return 0;
+}
+
+/**
+ * Reset the decoding state after all tasks completed. The task fields read by
+ * idle workers are already back to their initial values, and tasks are
+ * rewritten whenever their slots are filled, so they are left out of the
+ * memsets to avoid racing with these scans. task_gens keeps counting to
+ * detect slots reused across the reset.
+ */
 static void clear_decoder(Edge264Decoder *dec) {
-	memset((void *)dec + offsetof(Edge264Decoder, nal_ref_idc), 0, offsetof(Edge264Decoder, log_base_us) - offsetof(Edge264Decoder, nal_ref_idc));
+	memset((void *)dec + offsetof(Edge264Decoder, nal_ref_idc), 0, offsetof(Edge264Decoder, pending_tasks) - offsetof(Edge264Decoder, nal_ref_idc));
+	memset((void *)dec + offsetof(Edge264Decoder, decoded_mbs), 0, offsetof(Edge264Decoder, tasks) - offsetof(Edge264Decoder, decoded_mbs));
+	__atomic_store_n(&dec->output_heads, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&dec->output_count, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&dec->notified_frames, 0, __ATOMIC_RELAXED);
 	dec->currPic = dec->basePic = -1;
 	dec->PrevRefFrameNum[0] = dec->PrevRefFrameNum[1] = -1;
-	dec->taskPics_v = dec->output_queue_v[0][0] = dec->output_queue_v[0][1] =
+	dec->output_queue_v[0][0] = dec->output_queue_v[0][1] =
 		dec->output_queue_v[1][0] = dec->output_queue_v[1][1] = set8(-1);
 }
 
@@ -182,6 +452,11 @@ static void initialize_context(Edge264Context *ctx, int currPic)
 	ctx->samples_mb[2] = ctx->samples_mb[1] + (ctx->t.stride[1] >> 1);
 	int mb_offset = ctx->mbx + ctx->mby * (ctx->t.pic_width_in_mbs + 1);
 	ctx->mbCol = ctx->_mb = ctx->t.mb_buffer + mb_offset;
+	if (ctx->t.mb_window && ctx->CurrMbAddr == 0) {
+		start_window_row(ctx);
+	} else if (ctx->t.mb_window) { // later slices continue the last row started
+		ctx->_mb = ctx->t.mb_buffer + ctx->mbx + window_row(ctx->mby) * (ctx->t.pic_width_in_mbs + 1);
+	}
 	ctx->A4x4_int8_v = (i16x16){0, 0, 2, 2, 1, 4, 3, 6, 8, 8, 10, 10, 9, 12, 11, 14};
 	ctx->B4x4_int8_v = (i32x16){0, 1, 0, 1, 4, 5, 4, 5, 2, 3, 8, 9, 6, 7, 12, 13};
 	if (ctx->t.ChromaArrayType == 1) {
@@ -407,6 +682,8 @@ static void recover_slice(Edge264Context *ctx, int currPic) {
 				mb->nC_v[0] = (i8x16){};
 				decode_direct_mv_pred(ctx, 0xffffffff);
 			}
+			if (ctx->t.motion_buffer != NULL)
+				store_mb_motion(ctx);
 		}
 		__atomic_store_n(&ctx->_mb->recovery_bits, ctx->t.frame_flip_bit + 2, __ATOMIC_RELEASE);
 		
@@ -444,38 +721,409 @@ static void recover_slice(Edge264Context *ctx, int currPic) {
 
 
 /**
- * This function is the entry point for worker threads, where they consume
- * tasks continuously until stopped by the parent process.
+ * Deblock all mbs from ctx->t.next_deblock_addr up to end (excluded).
+ */
+static void deblock_mbs(Edge264Context *ctx, int currPic, int end) {
+	if (ctx->t.next_deblock_addr >= end)
+		return;
+	ctx->mby = (unsigned)ctx->t.next_deblock_addr / (unsigned)ctx->t.pic_width_in_mbs;
+	ctx->mbx = (unsigned)ctx->t.next_deblock_addr % (unsigned)ctx->t.pic_width_in_mbs;
+	ctx->samples_mb[0] = ctx->t.samples_buffers[currPic] + (ctx->mbx + ctx->mby * ctx->t.stride[0]) * 16;
+	ctx->samples_mb[1] = ctx->t.samples_buffers[currPic] + (ctx->mbx + ctx->mby * ctx->t.stride[1]) * 8 + ctx->t.plane_size_Y;
+	ctx->samples_mb[2] = ctx->samples_mb[1] + (ctx->t.stride[1] >> 1);
+	ctx->_mb = (Edge264Macroblock *)ctx->t.mb_buffer + ctx->mbx + ctx->mby * (ctx->t.pic_width_in_mbs + 1);
+	if (ctx->t.mb_window) { // rows pending deblocking are at most 1 above the last started row
+		int last = min((unsigned)end / (unsigned)ctx->t.pic_width_in_mbs, ctx->t.pic_height_in_mbs - 1);
+		ctx->_mb = ctx->t.mb_buffer + ctx->mbx + (window_row(last) - last + ctx->mby) * (ctx->t.pic_width_in_mbs + 1);
+	}
+	while (ctx->t.next_deblock_addr < end) {
+		deblock_mb(ctx);
+		ctx->t.next_deblock_addr++;
+		ctx->_mb++;
+		ctx->mbx++;
+		ctx->samples_mb[0] += 16;
+		ctx->samples_mb[1] += 8;
+		ctx->samples_mb[2] += 8;
+		if (ctx->mbx >= ctx->t.pic_width_in_mbs) {
+			ctx->_mb++;
+			ctx->mbx = 0;
+			ctx->samples_mb[0] += ctx->t.stride[0] * 16 - ctx->t.pic_width_in_mbs * 16;
+			ctx->samples_mb[1] += ctx->t.stride[1] * 8 - ctx->t.pic_width_in_mbs * 8;
+			ctx->samples_mb[2] += ctx->t.stride[1] * 8 - ctx->t.pic_width_in_mbs * 8;
+		}
+	}
+}
+
+
+
+/**
+ * With EDGE264_DEBLOCK_STAGE, this function follows the decoding of a slice on
+ * another worker, and deblocks each mb once the mb below it has been decoded,
+ * as would be done inline. It returns the return code of the slice, after
+ * which the caller completes the slice in its place.
+ */
+static int deblock_behind(Edge264Context *ctx, int task_id, int currPic) {
+	int32_t decoded;
+	while ((decoded = __atomic_load_n(&ctx->d->decoded_mbs[task_id], __ATOMIC_ACQUIRE)) >= 0) {
+		if (decoded - ctx->t.pic_width_in_mbs > ctx->t.next_deblock_addr && !__atomic_load_n(&ctx->d->cancel_tasks, __ATOMIC_ACQUIRE)) {
+			deblock_mbs(ctx, currPic, decoded - ctx->t.pic_width_in_mbs);
+			if (ctx->t.next_deblock_idc >= 0) {
+				__atomic_store_n(&ctx->d->next_deblock_addr[ctx->t.next_deblock_idc], ctx->t.next_deblock_addr, __ATOMIC_RELEASE);
+				unpark(ctx->d->pool, &ctx->d->next_deblock_addr[ctx->t.next_deblock_idc]);
+			}
+		}
+		park(ctx->d->pool, &ctx->d->decoded_mbs[task_id], decoded);
+	}
+	ctx->CurrMbAddr = ~decoded;
+	return ctx->d->decoded_results[task_id];
+}
+
+
+
+/**
+ * Make sure the ring of a group of reconstruction tasks can hold their rows
+ * in flight plus the row progress of the frame. The buffer is kept across
+ * slices to avoid reallocations.
+ */
+static int alloc_recon_ring(Edge264Decoder *dec, int recon_id, Edge264Task *t, int n_tasks) {
+	int ring_mbs = (n_tasks + REC_RING_ROWS - 1) * t->pic_width_in_mbs;
+	int size = ring_mbs * REC_SLOT_WORDS + t->pic_height_in_mbs;
+	if (dec->recon_ring_sizes[recon_id] < size) {
+		free(dec->recon_rings[recon_id]);
+		dec->recon_ring_sizes[recon_id] = 0;
+		if ((dec->recon_rings[recon_id] = malloc(size * sizeof(int32_t))) == NULL)
+			return ENOMEM;
+		dec->recon_ring_sizes[recon_id] = size;
+	}
+	dec->recon_ring_mbs[recon_id] = ring_mbs;
+	dec->recon_rows[recon_id] = dec->recon_rings[recon_id] + ring_mbs * REC_SLOT_WORDS;
+	memset(dec->recon_rows[recon_id], 0, t->pic_height_in_mbs * sizeof(int32_t));
+	return 0;
+}
+
+/**
+ * Point the ring of recorded operations of a slice to the buffer of its
+ * reconstruction tasks.
+ */
+static void init_recon_ring(Edge264Context *ctx, int recon_id) {
+	ctx->rec_ring = ctx->rec_slot = ctx->d->recon_rings[recon_id];
+	ctx->rec_ring_end = ctx->rec_ring + ctx->d->recon_ring_mbs[recon_id] * REC_SLOT_WORDS;
+}
+
+/**
+ * Execute the operations recorded for the current mb, in the order they were
+ * recorded by parse_slice_data.
+ */
+static void recon_mb(Edge264Context *ctx, const int32_t *slot) {
+	ctx->t.QP_s = (i8x4)slot[1];
+	for (const int32_t *r = slot + 2, *end = slot + slot[0]; r < end; ) {
+		int op = r[0] & 255;
+		if (op == REC_INTER) {
+			decode_inter(ctx, r[0] >> 8 & 255, r[0] >> 16 & 255, r[0] >> 24 & 255);
+			r += 1;
+			continue;
+		}
+		int iYCbCr = r[0] >> 8 & 255;
+		int arg = (int8_t)(r[0] >> 16);
+		uint8_t *p = ctx->samples_mb[iYCbCr] + r[1];
+		size_t stride = ctx->t.stride[iYCbCr];
+		r += 2;
+		switch (op) {
+		case REC_INTRA4x4:
+			decode_intra4x4(p, stride, arg, ctx->t.samples_clip_v[iYCbCr]);
+			break;
+		case REC_INTRA8x8:
+			decode_intra8x8(p, stride, arg, ctx->t.samples_clip_v[iYCbCr]);
+			break;
+		case REC_INTRA16x16:
+			decode_intra16x16(p, stride, arg, ctx->t.samples_clip_v[iYCbCr]);
+			break;
+		case REC_INTRA_CHROMA:
+			decode_intraChroma(p, ctx->t.stride[1] >> 1, arg, ctx->t.samples_clip_v[1]);
+			break;
+		case REC_IDCT4x4:
+			memcpy(ctx->c, r, 64);
+			if (arg >= 0)
+				ctx->c[16 + arg] = r[16];
+			add_idct4x4(ctx, iYCbCr, arg, p);
+			r += 17;
+			break;
+		case REC_DC4x4:
+			ctx->c[16 + arg] = r[0];
+			add_dc4x4(ctx, iYCbCr, arg, p);
+			r += 1;
+			break;
+		case REC_IDCT8x8:
+			memcpy(ctx->c, r, 256);
+			add_idct8x8(ctx, iYCbCr, p);
+			r += 64;
+			break;
+		case REC_DC16x16:
+			add_dc16x16(ctx, iYCbCr, loadu128(r), loadu128(r + 4), loadu128(r + 8), loadu128(r + 12));
+			r += 16;
+			break;
+		case REC_DC8x8:
+			add_dc8x8(ctx, loadu128(r), loadu128(r + 4));
+			r += 8;
+			break;
+		}
+	}
+}
+
+/**
+ * Reconstruct a row of mbs once parsed, deblocking each mbB while in cache as
+ * parse_slice_data would. Each mb waits for the row above to be two mbs ahead,
+ * which covers intra prediction from mbC and the deblocking of mbB after its
+ * right neighbour, so that rows progress in a wavefront. Row ends publish the
+ * progress of the frame before the row itself, to keep it monotonic. Returns
+ * 0 if the slice ended before the end of the row.
+ */
+static int recon_row(Edge264Context *ctx, int recon_id, int mby, int owns_deblock) {
+	Edge264Decoder *dec = ctx->d;
+	int width = ctx->t.pic_width_in_mbs;
+	int32_t decoded;
+	while ((decoded = __atomic_load_n(&dec->decoded_mbs[recon_id], __ATOMIC_ACQUIRE)) >= 0 && decoded < (mby + 1) * width)
+		park(dec->pool, &dec->decoded_mbs[recon_id], decoded);
+	int end = decoded < 0 ? min(~decoded, (mby + 1) * width) : (mby + 1) * width;
+	if (end <= mby * width)
+		return 0;
+	
+	// point to the start of the row
+	ctx->CurrMbAddr = mby * width;
+	ctx->mbx = 0;
+	ctx->mby = mby;
+	ctx->samples_mb[0] = ctx->t.samples_buffers[dec->taskPics[recon_id]] + mby * ctx->t.stride[0] * 16;
+	ctx->samples_mb[1] = ctx->t.samples_buffers[dec->taskPics[recon_id]] + mby * ctx->t.stride[1] * 8 + ctx->t.plane_size_Y;
+	ctx->samples_mb[2] = ctx->samples_mb[1] + (ctx->t.stride[1] >> 1);
+	ctx->_mb = (Edge264Macroblock *)ctx->t.mb_buffer + mby * (width + 1);
+	ctx->rec_slot = ctx->rec_ring + ctx->CurrMbAddr % dec->recon_ring_mbs[recon_id] * REC_SLOT_WORDS;
+	if (owns_deblock)
+		ctx->t.next_deblock_addr = max(mby - 1, 0) * width;
+	int32_t *above = dec->recon_rows[recon_id] + mby - 1;
+	int32_t *progress = dec->recon_rows[recon_id] + mby;
+	
+	while (ctx->CurrMbAddr < end) {
+		if (mby > 0)
+			wait_progress(dec->pool, above, min(ctx->mbx + 2, width));
+		recon_mb(ctx, ctx->rec_slot);
+		ctx->rec_slot += REC_SLOT_WORDS;
+		if (ctx->rec_slot == ctx->rec_ring_end)
+			ctx->rec_slot = ctx->rec_ring;
+		if (ctx->CurrMbAddr - width == ctx->t.next_deblock_addr) {
+			ctx->t.next_deblock_addr += 1;
+			ctx->_mb -= width + 1;
+			ctx->samples_mb[0] -= ctx->t.stride[0] * 16;
+			ctx->samples_mb[1] -= ctx->t.stride[1] * 8;
+			ctx->samples_mb[2] -= ctx->t.stride[1] * 8;
+			deblock_mb(ctx);
+			ctx->_mb += width + 2;
+			ctx->samples_mb[0] += ctx->t.stride[0] * 16 + 16;
+			ctx->samples_mb[1] += ctx->t.stride[1] * 8 + 8;
+			ctx->samples_mb[2] += ctx->t.stride[1] * 8 + 8;
+		} else {
+			ctx->_mb++;
+			ctx->samples_mb[0] += 16;
+			ctx->samples_mb[1] += 8;
+			ctx->samples_mb[2] += 8;
+		}
+		ctx->mbx++;
+		ctx->CurrMbAddr++;
+		if (ctx->mbx < width) {
+			signal_progress(dec->pool, progress, ctx->mbx);
+		} else {
+			if (ctx->t.next_deblock_idc >= 0) {
+				__atomic_store_n(&dec->next_deblock_addr[ctx->t.next_deblock_idc],
+					(ctx->t.disable_deblocking_filter_idc != 1) ? ctx->t.next_deblock_addr : ctx->CurrMbAddr,
+					__ATOMIC_RELEASE);
+				unpark(dec->pool, &dec->next_deblock_addr[ctx->t.next_deblock_idc]);
+			}
+			__atomic_store_n(&dec->reconstructed_mbs[recon_id], ctx->CurrMbAddr, __ATOMIC_RELEASE);
+			unpark(dec->pool, &dec->reconstructed_mbs[recon_id]);
+			signal_progress(dec->pool, progress, width);
+		}
+	}
+	return end == (mby + 1) * width;
+}
+
+/**
+ * With EDGE264_RECON_STAGE, a slice is followed by a group of tasks which
+ * claim its rows in order and replay the operations recorded for them. When
+ * no row is left, tasks of the group that were not started yet are dropped.
+ * The last task to exit gets the return code of the slice, and completes it
+ * in its place. It returns -1 for the other tasks.
+ */
+static int recon_behind(Edge264Context *ctx) {
+	Edge264Decoder *dec = ctx->d;
+	int recon_id = ctx->t.stage_task;
+	int owns_deblock = ctx->t.next_deblock_addr >= 0;
+	for (int mby; (mby = __atomic_fetch_add(&dec->recon_next_row[recon_id], 1, __ATOMIC_RELAXED)) < ctx->t.pic_height_in_mbs &&
+		recon_row(ctx, recon_id, mby, owns_deblock); );
+	
+	// tasks of the group that workers did not claim yet are the pending bits we clear
+	uint64_t dropped = __atomic_fetch_and(&dec->pending_tasks, ~dec->stage_groups[recon_id], __ATOMIC_ACQ_REL) & dec->stage_groups[recon_id];
+	if (__atomic_sub_fetch(&dec->recon_active[recon_id], 1 + __builtin_popcountll(dropped), __ATOMIC_ACQ_REL) > 0)
+		return -1;
+	int32_t decoded;
+	while ((decoded = __atomic_load_n(&dec->decoded_mbs[recon_id], __ATOMIC_ACQUIRE)) >= 0)
+		park(dec->pool, &dec->decoded_mbs[recon_id], decoded);
+	ctx->CurrMbAddr = ~decoded;
+	if (owns_deblock)
+		ctx->t.next_deblock_addr = max(ctx->CurrMbAddr - ctx->t.pic_width_in_mbs, 0);
+	return dec->decoded_results[recon_id];
+}
+
+/**
+ * Called by a recording slice at the end of each row, to wait until its
+ * reconstruction tasks have consumed the slots of the next row. If no worker
+ * has picked any of them yet, the slice takes them back to replay the rows it
+ * recorded, then continues decoding samples directly.
+ */
+static noinline void wait_recon_room(Edge264Context *ctx) {
+	Edge264Decoder *dec = ctx->d;
+	int recon_id = ctx->t.stage_task;
+	uint64_t group = dec->stage_groups[recon_id];
+	int min_addr = ctx->CurrMbAddr + ctx->t.pic_width_in_mbs - dec->recon_ring_mbs[recon_id];
+	int32_t progress = __atomic_load_n(&dec->reconstructed_mbs[recon_id], __ATOMIC_ACQUIRE);
+	if (progress >= min_addr)
+		return;
+	
+	// take back the whole group at once only if no worker claimed any of it
+	uint64_t pending = __atomic_load_n(&dec->pending_tasks, __ATOMIC_ACQUIRE);
+	int idle;
+	while ((idle = (pending & group) == group) &&
+	       !__atomic_compare_exchange_n(&dec->pending_tasks, &pending, pending & ~group, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	if (idle) {
+		Edge264Context r;
+		r.d = dec;
+		r.thread_id = ctx->thread_id;
+		r.t = dec->tasks[recon_id];
+		initialize_context(&r, dec->taskPics[recon_id]);
+		init_recon_ring(&r, recon_id);
+		r.rec = NULL;
+		for (int mby = 0; mby < ctx->mby; mby++)
+			recon_row(&r, recon_id, mby, r.t.next_deblock_addr >= 0);
+		ctx->t.next_deblock_idc = r.t.next_deblock_idc;
+		ctx->t.next_deblock_addr = r.t.next_deblock_addr;
+		ctx->t.stage_task = -1;
+		ctx->rec = NULL;
+		release_tasks(dec, group, ctx->thread_id);
+		return;
+	}
+	while ((progress = __atomic_load_n(&dec->reconstructed_mbs[recon_id], __ATOMIC_ACQUIRE)) < min_addr)
+		park(dec->pool, &dec->reconstructed_mbs[recon_id], progress);
+}
+
+
+
+/**
+ * Called when all mbs of a slice are deblocked. If the deblocking progress of
+ * the frame has reached the start of the slice, it moves to its end, then past
+ * any slices that completed ahead of it. Otherwise the slice is recorded to be
+ * merged later, which lets slices with disable_deblocking_filter_idc!=0 signal
+ * their rows to other frames in any order. Slices not fitting in the record
+ * are merged when the frame completes.
+ */
+static void merge_deblocked_slice(Edge264Context *ctx, int currPic) {
+	Edge264Decoder *dec = ctx->d;
+	int32_t (*ranges)[2] = dec->deblocked_ranges[currPic];
+	if (dec->n_threads)
+		pthread_mutex_lock(&dec->merge_lock);
+	if (__atomic_load_n(&dec->next_deblock_addr[currPic], __ATOMIC_ACQUIRE) >= ctx->t.first_mb_in_slice) {
+		int progress = ctx->CurrMbAddr;
+		for (int i = 0; i < dec->deblocked_slices[currPic]; i++) {
+			if (ranges[i][0] == progress) {
+				progress = ranges[i][1];
+				int last = --dec->deblocked_slices[currPic];
+				ranges[i][0] = ranges[last][0];
+				ranges[i][1] = ranges[last][1];
+				i = -1;
+			}
+		}
+		__atomic_store_n(&dec->next_deblock_addr[currPic], progress, __ATOMIC_RELEASE);
+		if (ctx->thread_id >= 0)
+			unpark(dec->pool, &dec->next_deblock_addr[currPic]);
+	} else if (dec->deblocked_slices[currPic] < DEBLOCKED_RANGES) {
+		int i = dec->deblocked_slices[currPic]++;
+		ranges[i][0] = ctx->t.first_mb_in_slice;
+		ranges[i][1] = ctx->CurrMbAddr;
+	}
+	if (dec->n_threads)
+		pthread_mutex_unlock(&dec->merge_lock);
+}
+
+/**
+ * With EDGE264_NV12, copies the Cb and Cr halves of each chroma row into the
+ * interleaved plane stored after them, once the frame is complete. Halves
+ * hold a multiple of 8 bytes but may not be aligned on 16 bytes.
+ */
+static void interleave_chroma(Edge264Context *ctx, int currPic) {
+	const uint8_t *src = ctx->t.samples_buffers[currPic] + ctx->t.plane_size_Y;
+	uint8_t *dst = (uint8_t *)src + ctx->t.plane_size_C;
+	int stride = ctx->t.stride[1];
+	int half = stride >> 1;
+	int depth = ctx->t.samples_clip[1][0] > 255;
+	int width = ctx->t.pic_width_in_mbs << (ctx->t.ChromaArrayType == 3 ? 4 : 3) << depth;
+	int rows = ctx->t.pic_height_in_mbs << (ctx->t.ChromaArrayType == 1 ? 3 : 4);
+	for (int y = 0; y < rows; y++, src += stride, dst += stride) {
+		for (int x = 0; x < width; x += 16) {
+			i8x16 cb, cr, lo, hi;
+			memcpy(&cb, src + x, 16);
+			memcpy(&cr, src + half + x, 16);
+			lo = depth ? (i8x16)ziplo16((i16x8)cb, (i16x8)cr) : ziplo8(cb, cr);
+			hi = depth ? (i8x16)ziphi16((i16x8)cb, (i16x8)cr) : ziphi8(cb, cr);
+			memcpy(dst + x * 2, &lo, 16);
+			if (x + 8 < width)
+				memcpy(dst + x * 2 + 16, &hi, 16);
+		}
+	}
+}
+
+
+
+/**
+ * This function decodes a task that was reserved by clearing its pending bit,
+ * either in a worker thread of the pool or in the parser (thread_id < 0).
  */
-void *ADD_VARIANT(worker_loop)(void *arg) {
+int ADD_VARIANT(run_task)(Edge264Decoder *dec, int task_id, int thread_id) {
 	Edge264Context c;
-	c.d = (void *)((uintptr_t)arg & -16);
-	c.thread_id = c.d->n_threads ? (uintptr_t)arg & 15 : -1;
+	c.d = dec;
+	c.thread_id = thread_id;
 	c.log_base_us = c.d->log_base_us;
 	c.log_cb = c.d->log_cb;
 	c.log_arg = c.d->log_arg;
 	c.log_indent = c.d->n_threads ? "  " : "    ";
 	c.log_pos = 0;
-	if (c.thread_id >= 0)
-		pthread_mutex_lock(&c.d->lock);
-	while (1) {
-		// wait until a task becomes available and reserve it
-		while (c.thread_id >= 0 && !c.d->ready_tasks)
-			pthread_cond_wait(&c.d->task_ready, &c.d->lock);
-		assert((unsigned)c.d->ready_tasks - 1 < 65535); // 0 < ready_tasks < 65536
-		int task_id = __builtin_ctz(c.d->ready_tasks); // FIXME arbitrary selection for now
-		int currPic = c.d->taskPics[task_id];
-		c.d->pending_tasks &= ~(1 << task_id);
-		c.d->ready_tasks &= ~(1 << task_id);
-		if (c.thread_id >= 0)
-			pthread_mutex_unlock(&c.d->lock);
-		unsigned long long clock_start = get_relative_time_us() - c.log_base_us;
-		c.t = c.d->tasks[task_id];
-		unsigned approx_byte_size = c.t.gb.end - c.t.gb.CPB;
-		initialize_context(&c, currPic);
+	int currPic = c.d->taskPics[task_id];
+	unsigned long long clock_start = get_relative_time_us() - c.log_base_us;
+	c.t = c.d->tasks[task_id];
+	unsigned approx_byte_size = c.t.gb.end - c.t.gb.CPB;
+	initialize_context(&c, currPic);
+	
+	size_t ret = 0;
+	uint64_t released = 1ull << task_id;
+	c.rec = NULL;
+	if (c.t.stage == STAGE_DEBLOCK) {
+		ret = deblock_behind(&c, task_id, currPic);
+	} else if (c.t.stage == STAGE_RECON) {
+		init_recon_ring(&c, c.t.stage_task);
+		int res = recon_behind(&c);
+		if (res < 0)
+			return 0; // the last task of the group completes the slice and releases it
+		ret = res;
+		released = c.d->stage_groups[c.t.stage_task];
+		c.t.stage_task = -1;
+	} else {
+		// the tasks following a slice may start along with it
+		if (c.t.stage_task >= 0) {
+			if (c.d->tasks[c.t.stage_task].stage == STAGE_RECON) {
+				init_recon_ring(&c, c.t.stage_task);
+				c.rec = c.rec_slot;
+			}
+			__atomic_or_fetch(&c.d->pending_tasks, c.d->stage_groups[c.t.stage_task], __ATOMIC_RELEASE);
+			wake_workers(c.d->pool);
+		}
 		
 		// call the function containing the macroblock decoding loop
-		size_t ret = 0;
 		if (!c.t.pps.entropy_coding_mode_flag) {
 			c.mb_skip_run = -1;
 			parse_slice_data_cavlc(&c);
@@ -497,109 +1145,64 @@ void *ADD_VARIANT(worker_loop)(void *arg) {
 		if (c.t.unref_cb)
 			c.t.unref_cb((int)ret, c.t.unref_arg);
 		
+		// hand the rest of the slice to its deblocking or reconstruction task if any
+		if (c.t.stage_task >= 0) {
+			c.d->decoded_results[c.t.stage_task] = ret;
+			__atomic_store_n(&c.d->decoded_mbs[c.t.stage_task], ~c.CurrMbAddr, __ATOMIC_RELEASE);
+			unpark(c.d->pool, &c.d->decoded_mbs[c.t.stage_task]);
+		}
+	}
+	
+	// otherwise complete the slice and possibly the frame, unless edge264_flush discards it
+	if (c.t.stage_task < 0 && !__atomic_load_n(&c.d->cancel_tasks, __ATOMIC_ACQUIRE)) {
 		// deblock the rest of mbs in this slice
 		if (c.t.next_deblock_addr >= 0) {
 			c.t.next_deblock_addr = max(c.t.next_deblock_addr, c.t.first_mb_in_slice);
-			c.mby = (unsigned)c.t.next_deblock_addr / (unsigned)c.t.pic_width_in_mbs;
-			c.mbx = (unsigned)c.t.next_deblock_addr % (unsigned)c.t.pic_width_in_mbs;
-			c.samples_mb[0] = c.t.samples_buffers[currPic] + (c.mbx + c.mby * c.t.stride[0]) * 16;
-			c.samples_mb[1] = c.t.samples_buffers[currPic] + (c.mbx + c.mby * c.t.stride[1]) * 8 + c.t.plane_size_Y;
-			c.samples_mb[2] = c.samples_mb[1] + (c.t.stride[1] >> 1);
-			c._mb = (Edge264Macroblock *)c.t.mb_buffer + c.mbx + c.mby * (c.t.pic_width_in_mbs + 1);
-			while (c.t.next_deblock_addr < c.CurrMbAddr) {
-				deblock_mb(&c);
-				c.t.next_deblock_addr++;
-				c._mb++;
-				c.mbx++;
-				c.samples_mb[0] += 16;
-				c.samples_mb[1] += 8;
-				c.samples_mb[2] += 8;
-				if (c.mbx >= c.t.pic_width_in_mbs) {
-					c._mb++;
-					c.mbx = 0;
-					c.samples_mb[0] += c.t.stride[0] * 16 - c.t.pic_width_in_mbs * 16;
-					c.samples_mb[1] += c.t.stride[1] * 8 - c.t.pic_width_in_mbs * 8;
-					c.samples_mb[2] += c.t.stride[1] * 8 - c.t.pic_width_in_mbs * 8;
-				}
-			}
+			deblock_mbs(&c, currPic, c.CurrMbAddr);
 		}
 		
-		// on error, recover mbs and signal them as erroneous (allows overwrite by redundant slices)
-		if (__builtin_expect(ret != 0, 0))
+		// on error, recover mbs and signal them as erroneous (allows overwrite by redundant slices),
+		// except in a window of mb rows where the first rows of the slice are gone
+		if (__builtin_expect(ret != 0, 0) && !c.t.mb_window)
 			recover_slice(&c, currPic);
 		
-		// update c.d->next_deblock_addr, considering it might have reached first_mb_in_slice since start
-		if (c.d->next_deblock_addr[currPic] >= c.t.first_mb_in_slice &&
-		    !(c.t.disable_deblocking_filter_idc == 0 && c.t.next_deblock_addr < 0)) {
-			c.d->next_deblock_addr[currPic] = c.CurrMbAddr;
-			pthread_cond_broadcast(&c.d->task_progress);
-		}
+		// update c.d->next_deblock_addr if all mbs of the slice are deblocked
+		if (!(c.t.disable_deblocking_filter_idc == 0 && c.t.next_deblock_addr < 0))
+			merge_deblocked_slice(&c, currPic);
 		
 		// deblock the rest of the frame if all mbs have been decoded correctly
 		int remaining_mbs = ret ?: __atomic_sub_fetch(&c.d->remaining_mbs[currPic], c.CurrMbAddr - c.t.first_mb_in_slice, __ATOMIC_ACQ_REL);
 		if (remaining_mbs == 0) {
-			c.t.next_deblock_addr = c.d->next_deblock_addr[currPic];
+			c.t.next_deblock_addr = __atomic_load_n(&c.d->next_deblock_addr[currPic], __ATOMIC_ACQUIRE);
 			c.CurrMbAddr = c.t.pic_width_in_mbs * c.t.pic_height_in_mbs;
-			if ((unsigned)c.t.next_deblock_addr < c.CurrMbAddr) {
-				c.mby = (unsigned)c.t.next_deblock_addr / (unsigned)c.t.pic_width_in_mbs;
-				c.mbx = (unsigned)c.t.next_deblock_addr % (unsigned)c.t.pic_width_in_mbs;
-				c.samples_mb[0] = c.t.samples_buffers[currPic] + (c.mbx + c.mby * c.t.stride[0]) * 16;
-				c.samples_mb[1] = c.t.samples_buffers[currPic] + (c.mbx + c.mby * c.t.stride[1]) * 8 + c.t.plane_size_Y;
-				c.samples_mb[2] = c.samples_mb[1] + (c.t.stride[1] >> 1);
-				c._mb = (Edge264Macroblock *)c.t.mb_buffer + c.mbx + c.mby * (c.t.pic_width_in_mbs + 1);
-				while (c.t.next_deblock_addr < c.CurrMbAddr) {
-					deblock_mb(&c);
-					c.t.next_deblock_addr++;
-					c._mb++;
-					c.mbx++;
-					c.samples_mb[0] += 16;
-					c.samples_mb[1] += 8;
-					c.samples_mb[2] += 8;
-					if (c.mbx >= c.t.pic_width_in_mbs) {
-						c._mb++;
-						c.mbx = 0;
-						c.samples_mb[0] += c.t.stride[0] * 16 - c.t.pic_width_in_mbs * 16;
-						c.samples_mb[1] += c.t.stride[1] * 8 - c.t.pic_width_in_mbs * 8;
-						c.samples_mb[2] += c.t.stride[1] * 8 - c.t.pic_width_in_mbs * 8;
-					}
-				}
-			}
-			c.d->next_deblock_addr[currPic] = INT_MAX; // signals the frame is complete
-		}
-		
-		// print benchmarking information
-		if (c.log_cb) {
-			unsigned long long clock_end = get_relative_time_us() - c.log_base_us;
-			snprintf(c.log_buf, sizeof(c.log_buf),
-				"\n- thread_id: %d\n"
-				"  FrameId: %u\n"
-				"  first_mb_in_slice: %u\n"
-				"  approx_byte_size: %u\n"
-				"  decoding_start_us: %llu\n"
-				"  decoding_end_us: %llu\n"
-				"  slice_result: %s\n",
-				c.thread_id, c.t.FrameId, c.t.first_mb_in_slice, approx_byte_size, clock_start, clock_end, ret_to_str(ret));
-			c.log_cb(c.log_buf, c.log_arg);
-		}
-		
-		// if multi-threaded, check if we are the last task to touch this frame and ensure it is complete
-		if (c.thread_id >= 0) {
-			pthread_mutex_lock(&c.d->lock);
-			pthread_cond_signal(&c.d->task_complete);
-			if (remaining_mbs == 0) {
-				pthread_cond_broadcast(&c.d->task_progress);
-				c.d->ready_tasks = ready_tasks(c.d);
-				if (c.d->ready_tasks)
-					pthread_cond_broadcast(&c.d->task_ready);
-			}
+			deblock_mbs(&c, currPic, c.CurrMbAddr);
+			if (c.d->out.interleaved_CbCr)
+				interleave_chroma(&c, currPic);
+			__atomic_exchange_n(&c.d->next_deblock_addr[currPic], INT_MAX, __ATOMIC_SEQ_CST); // signals the frame is complete, ordered with output_heads for notify_frame_ready
+			if (c.thread_id >= 0)
+				unpark(c.d->pool, &c.d->next_deblock_addr[currPic]);
+			notify_frame_ready(c.d);
 		}
-		c.d->busy_tasks &= ~(1 << task_id);
-		c.d->task_dependencies[task_id] = 0;
-		c.d->taskPics[task_id] = -1;
-		if (c.thread_id < 0)
-			return (void *)ret;
 	}
-	return NULL;
+	
+	// print benchmarking information
+	if (c.log_cb && !c.t.stage) {
+		unsigned long long clock_end = get_relative_time_us() - c.log_base_us;
+		snprintf(c.log_buf, sizeof(c.log_buf),
+			"\n- thread_id: %d\n"
+			"  FrameId: %u\n"
+			"  first_mb_in_slice: %u\n"
+			"  approx_byte_size: %u\n"
+			"  decoding_start_us: %llu\n"
+			"  decoding_end_us: %llu\n"
+			"  slice_result: %s\n",
+			c.thread_id, c.t.FrameId, c.t.first_mb_in_slice, approx_byte_size, clock_start, clock_end, ret_to_str(ret));
+		c.log_cb(c.log_buf, c.log_arg);
+	}
+	
+	// release the task slots and their references
+	release_tasks(c.d, released, c.thread_id);
+	return ret;
 }
 
 
@@ -782,7 +1385,7 @@ static void parse_ref_pic_list_modification(Edge264Decoder *dec, Edge264SeqParam
 		}
 	}
 	if (dec->nal_unit_type == 20) // if we're second view
-		t->RefPicList[0][size++] = dec->basePic; // add inter-view ref for MVC
+		t->RefPicList[0][size++] = dec->basePic; // add inter-view ref for MVC, waited on per row like other refs
 	
 	// fill RefPicListL1 by swapping before/after references
 	for (int src = 0; src < size; src++) {
@@ -889,6 +1492,14 @@ static void parse_ref_pic_list_modification(Edge264Decoder *dec, Edge264SeqParam
 
 
 
+// dense motion field stored after the mbs of a frame, aligned on a cache line, or NULL without direct_8x8_inference_flag
+static Edge264MbMotion *motion_field(Edge264Decoder *dec, Edge264SeqParameterSet *sps, int pic) {
+	if (!sps->direct_8x8_inference_flag)
+		return NULL;
+	int mbs = (sps->pic_width_in_mbs + 1) * sps->pic_height_in_mbs - 1;
+	return (Edge264MbMotion *)(((uintptr_t)(dec->mb_buffers[pic] + mbs) + 63) & -64);
+}
+
 /**
  * This fonction copies the last set of fields to finish initializing the task.
  */
@@ -919,17 +1530,21 @@ static void initialize_task(Edge264Decoder *dec, Edge264SeqParameterSet *sps, Ed
 	t->FrameId = dec->FrameIds[dec->currPic];
 	t->plane_size_Y = dec->plane_size_Y;
 	t->plane_size_C = dec->plane_size_C;
-	t->next_deblock_idc = (dec->next_deblock_addr[dec->currPic] == t->first_mb_in_slice &&
-		dec->nal_ref_idc) ? dec->currPic : -1;
-	t->next_deblock_addr = (dec->next_deblock_addr[dec->currPic] == t->first_mb_in_slice ||
+	int deblocked = __atomic_load_n(&dec->next_deblock_addr[dec->currPic], __ATOMIC_ACQUIRE); // may be advanced by workers
+	t->next_deblock_idc = (deblocked == t->first_mb_in_slice && dec->nal_ref_idc) ? dec->currPic : -1;
+	t->next_deblock_addr = (deblocked == t->first_mb_in_slice ||
 		t->disable_deblocking_filter_idc == 2) ? t->first_mb_in_slice : INT_MIN;
 	t->prev_long_term_frames = dec->prev_long_term_frames & ~dec->prev_short_term_frames; // mask of only long-term frames
-	t->mb_buffer = (Edge264Macroblock *)dec->mb_buffers[dec->currPic];
+	t->mb_window = dec->window_frames >> dec->currPic & 1;
+	int light = (dec->window_frames | dec->spilled_frames) >> dec->currPic & 1;
+	t->mb_buffer = light ? dec->mb_window_buffer : (Edge264Macroblock *)dec->mb_buffers[dec->currPic];
+	t->motion_buffer = light ? NULL : motion_field(dec, sps, dec->currPic); // non-reference pictures are never co-located
 	memcpy(t->samples_buffers, dec->samples_buffers, sizeof(t->samples_buffers));
 	t->samples_clip_v[0] = set16((1 << sps->BitDepth_Y) - 1);
 	t->samples_clip_v[1] = t->samples_clip_v[2] = set16((1 << sps->BitDepth_C) - 1);
 	if (t->slice_type == 1) { // B slices
 		t->mbCol_buffer = (Edge264Macroblock *)dec->mb_buffers[t->RefPicList[1][0]];
+		t->motionCol_buffer = motion_field(dec, sps, t->RefPicList[1][0]);
 		if (t->pps.weighted_bipred_idc == 2 || !t->direct_spatial_mv_pred_flag) {
 			u32x4 poc = set32(minw(dec->TopFieldOrderCnt, dec->BottomFieldOrderCnt));
 			t->diff_poc_v[0] = packs32(poc - minw32(dec->FieldOrderCnt_v[0][0], dec->FieldOrderCnt_v[1][0]),
@@ -956,11 +1571,19 @@ int ADD_VARIANT(parse_slice_layer_without_partitioning)(Edge264Decoder *dec, Edg
 	static const char * const disable_deblocking_filter_idc_names[3] = {"enabled", "disabled", "sliced"};
 	int ret;
 	
-	// find and reserve an empty task to fill
-	unsigned avail_tasks;
-	while (!(avail_tasks = 0xffff & ~dec->busy_tasks))
-		pthread_cond_wait(&dec->task_complete, &dec->lock);
-	Edge264Task *t = dec->tasks + __builtin_ctz(avail_tasks);
+	// find and reserve an empty task to fill, lending one more worker to the decoder if it ran out of them
+	uint64_t avail_tasks;
+	if (dec->n_threads && !(dec->task_slots & ~__atomic_load_n(&dec->busy_tasks, __ATOMIC_ACQUIRE)) && !dec->parser_stalled) {
+		dec->parser_stalled = 1;
+		if (dec->auto_workers < dec->n_threads) {
+			__atomic_store_n(&dec->auto_workers, dec->auto_workers + 1, __ATOMIC_RELAXED);
+			wake_workers(dec->pool);
+		}
+	}
+	for (uint32_t seq; seq = __atomic_load_n(&dec->task_releases, __ATOMIC_ACQUIRE),
+	     !(avail_tasks = dec->task_slots & ~__atomic_load_n(&dec->busy_tasks, __ATOMIC_ACQUIRE)); )
+		wait_task_releases(dec, seq);
+	Edge264Task *t = dec->tasks + __builtin_ctzll(avail_tasks);
 	t->unref_cb = unref_cb;
 	t->unref_arg = unref_arg;
 	t->RefPicList_v[0] = t->RefPicList_v[1] = t->RefPicList_v[2] = t->RefPicList_v[3] =
@@ -1116,13 +1739,13 @@ int ADD_VARIANT(parse_slice_layer_without_partitioning)(Edge264Decoder *dec, Edg
 			return ENOBUFS; // exit here if we must wait for get_frame to consume and return enough frames
 		// wait until enough empty slots are undepended
 		unsigned unavail;
-		while (non_existing + __builtin_popcount(unavail = unavail_frames(dec) | depended_frames(dec)) > 32)
-			pthread_cond_wait(&dec->task_complete, &dec->lock);
+		for (uint32_t seq; seq = __atomic_load_n(&dec->task_releases, __ATOMIC_ACQUIRE),
+		     non_existing + __builtin_popcount(unavail = unavail_frames(dec) | depended_frames(dec)) > 32; )
+			wait_task_releases(dec, seq);
 		// finally insert the last non-existing frames one by one
 		for (unsigned FrameNum = dec->FrameNum - non_existing; FrameNum < dec->FrameNum; FrameNum++) {
 			int i = __builtin_ctz(~unavail);
-			if (dec->samples_buffers[i] == NULL &&
-				(ret = alloc_frame(dec, i, i <= sps->max_dec_frame_buffering ? ENOMEM : ENOBUFS)))
+			if ((ret = claim_frame(dec, i, 0, i <= sps->max_dec_frame_buffering ? ENOMEM : ENOBUFS)))
 				return ret;
 			unavail |= 1 << i;
 			dec->prev_short_term_frames |= 1 << i;
@@ -1150,21 +1773,48 @@ int ADD_VARIANT(parse_slice_layer_without_partitioning)(Edge264Decoder *dec, Edg
 			return ENOBUFS; // exit here if we must wait for get_frame to consume and return a frame slot
 		// wait until at least one empty slot is undepended (or returned in the meantime)
 		unsigned unavail;
-		while (__builtin_popcount(unavail = unavail_frames(dec) | depended_frames(dec)) >= 32)
-			pthread_cond_wait(&dec->task_complete, &dec->lock);
-		int currPic = __builtin_ctz(~unavail);
-		if (dec->samples_buffers[currPic] == NULL &&
-			(ret = alloc_frame(dec, currPic, currPic <= sps->max_dec_frame_buffering ? ENOMEM : ENOBUFS)))
+		for (uint32_t seq; seq = __atomic_load_n(&dec->task_releases, __ATOMIC_ACQUIRE),
+		     __builtin_popcount(unavail = unavail_frames(dec) | depended_frames(dec)) >= 32; )
+			wait_task_releases(dec, seq);
+		// with EDGE264_MB_WINDOW, single-threaded non-reference pictures need no mbs in their slot
+		int window = dec->mb_window && !dec->n_threads && !dec->nal_ref_idc && !dec->ssps.BitDepth_Y && t->first_mb_in_slice == 0;
+		unsigned avail = ~unavail;
+		if (dec->mb_window) {
+			unsigned full = 0, light = 0;
+			for (unsigned a = avail; a; a &= a - 1) {
+				int i = __builtin_ctz(a);
+				if (dec->samples_buffers[i] != NULL)
+					*(dec->mb_sizes[i] >= frame_mbs_size(&dec->sps, 0) ? &full : &light) |= 1 << i;
+			}
+			avail = window ? light ?: full ?: avail : full ?: avail & ~light ?: avail;
+			if (window && (ret = alloc_mb_window(dec, sps->pic_width_in_mbs)))
+				return ret;
+		}
+		int currPic = __builtin_ctz(avail);
+		if ((ret = claim_frame(dec, currPic, window, currPic <= sps->max_dec_frame_buffering ? ENOMEM : ENOBUFS)))
 			return ret;
 		dec->currPic = currPic;
+		dec->window_frames = dec->window_frames & ~(1 << currPic) | window << currPic;
+		dec->spilled_frames &= ~(1 << currPic);
 		dec->non_base_frames = dec->non_base_frames & ~(1 << currPic) | non_base_view << currPic;
-		dec->frame_flip_bits ^= 1 << currPic;
+		dec->frame_flip_bits ^= !window << currPic; // the mbs of the slot are left untouched in mb_window_buffer
 		dec->FrameIds[currPic] = ++dec->prevFrameId;
 		dec->FrameNums[currPic] = dec->FrameNum;
 		dec->FieldOrderCnt[0][currPic] = dec->TopFieldOrderCnt;
 		dec->FieldOrderCnt[1][currPic] = dec->BottomFieldOrderCnt;
 		dec->remaining_mbs[currPic] = sps->pic_width_in_mbs * sps->pic_height_in_mbs;
 		dec->next_deblock_addr[currPic] = 0;
+		dec->deblocked_slices[currPic] = 0;
+		
+		// give back a lent worker for each frame that did not need it, down to the number needed for the picture size
+		// (counting both views with MVC, since the non-base view decodes a few rows behind the base view of the same access unit)
+		if (dec->n_threads) {
+			int mbs = dec->remaining_mbs[currPic] << (dec->ssps.BitDepth_Y != 0);
+			int size_workers = min((mbs + MBS_PER_WORKER - 1) / MBS_PER_WORKER, dec->n_threads);
+			int auto_workers = dec->parser_stalled ? max(dec->auto_workers, size_workers) : max(dec->auto_workers - 1, size_workers);
+			__atomic_store_n(&dec->auto_workers, auto_workers, __ATOMIC_RELAXED);
+			dec->parser_stalled = 0;
+		}
 		log_dec(dec, "  FrameId: %u\n", dec->FrameIds[currPic]);
 	}
 	
@@ -1246,6 +1896,7 @@ int ADD_VARIANT(parse_slice_layer_without_partitioning)(Edge264Decoder *dec, Edg
 			i8x16 *queue = dec->output_queue_v[non_base_view];
 			queue[1] = shrd128(queue[0], queue[1], 15);
 			queue[0] = shrd128(set8(dec->currPic), queue[0], 15);
+			publish_output_heads(dec);
 		} else if (__builtin_popcount(dec->to_get_frames & ~dec->output_frames & same_views) > sps->max_num_reorder_frames) {
 			bump_frame(dec, non_base_view, 0);
 		}
@@ -1267,23 +1918,75 @@ int ADD_VARIANT(parse_slice_layer_without_partitioning)(Edge264Decoder *dec, Edg
 		#endif
 	}
 	
+	// in a window of mb rows, a slice not continuing the rows of the previous one needs a whole frame of mbs
+	if ((dec->window_frames >> dec->currPic & 1) && t->first_mb_in_slice != dec->next_deblock_addr[dec->currPic] &&
+	    (ret = spill_mb_window(dec, dec->currPic)))
+		return print_dec(dec, "  decode_NAL_result: %s\n", ret);
+	
 	// prepare the task and signal it
 	initialize_task(dec, sps, t);
 	int task_id = t - dec->tasks;
-	dec->busy_tasks |= 1 << task_id;
-	dec->pending_tasks |= 1 << task_id;
-	dec->task_dependencies[task_id] = refs_to_mask(t);
-	// FIXME check against dependencies on non-reference slots
-	dec->ready_tasks |= ((dec->task_dependencies[task_id] & ~ready_frames(dec)) == 0) << task_id;
-	dec->taskPics[task_id] = dec->currPic;
-	ret = print_dec(dec, dec->n_threads || dec->worker_loop != worker_loop_log ?
+	renew_task(dec, task_id);
+	__atomic_store_n(&dec->task_dependencies[task_id], refs_to_mask(t), __ATOMIC_RELAXED); // FIXME check against dependencies on non-reference slots
+	__atomic_store_n(&dec->taskPics[task_id], dec->currPic, __ATOMIC_RELAXED);
+	
+	// with a reconstruction stage, a slice starting a frame hands its sample decoding to a group of tasks,
+	// otherwise with a deblocking stage, a slice owning the deblocking of its mbs hands it to a second task
+	t->stage_task = -1;
+	t->stage = 0;
+	uint64_t spare_tasks = dec->task_slots & ~__atomic_load_n(&dec->busy_tasks, __ATOMIC_ACQUIRE) & ~(1ull << task_id);
+	int stage = 0;
+	int n_stage_tasks = 1;
+	if (dec->n_threads && spare_tasks) {
+		if (dec->recon_stage && dec->pool->n_threads > 1 && t->first_mb_in_slice == 0 && t->ChromaArrayType <= 1) {
+			// leave half of the spare slots to the next slices
+			n_stage_tasks = min(min(dec->pool->n_threads - 1, t->pic_height_in_mbs), max(__builtin_popcountll(spare_tasks) >> 1, 1));
+			if (!alloc_recon_ring(dec, __builtin_ctzll(spare_tasks), t, n_stage_tasks))
+				stage = STAGE_RECON;
+		}
+		if (!stage && dec->deblock_stage && t->next_deblock_addr >= 0 && t->disable_deblocking_filter_idc != 1) {
+			stage = STAGE_DEBLOCK;
+			n_stage_tasks = 1;
+		}
+	}
+	if (stage) {
+		int stage_id = __builtin_ctzll(spare_tasks);
+		uint64_t group = 0;
+		for (int i = 0; i < n_stage_tasks; i++, spare_tasks &= spare_tasks - 1) {
+			int id = __builtin_ctzll(spare_tasks);
+			Edge264Task *d = dec->tasks + id;
+			memcpy(d, t, sizeof(*d));
+			d->stage = stage;
+			d->stage_task = (stage == STAGE_RECON) ? stage_id : -1;
+			d->unref_cb = NULL;
+			renew_task(dec, id);
+			__atomic_store_n(&dec->task_dependencies[id], dec->task_dependencies[task_id], __ATOMIC_RELAXED);
+			__atomic_store_n(&dec->taskPics[id], dec->currPic, __ATOMIC_RELAXED);
+			group |= 1ull << id;
+		}
+		t->stage_task = stage_id;
+		t->next_deblock_idc = -1;
+		t->next_deblock_addr = INT_MIN;
+		dec->stage_groups[stage_id] = group;
+		dec->recon_active[stage_id] = n_stage_tasks;
+		dec->recon_next_row[stage_id] = 0;
+		dec->decoded_mbs[stage_id] = t->first_mb_in_slice;
+		dec->reconstructed_mbs[stage_id] = t->first_mb_in_slice;
+		__atomic_or_fetch(&dec->busy_tasks, group, __ATOMIC_RELAXED); // made pending when the slice starts
+	}
+	ret = print_dec(dec, dec->n_threads || dec->run_task != run_task_log ?
 		"  decode_NAL_result: %s\n" : t->pps.entropy_coding_mode_flag ?
 		"  macroblocks_cabac:\n" : "  macroblocks_cavlc:\n", 0);
 	assert(__builtin_popcount(dpb_frames(dec) & same_views) <= sps->max_dec_frame_buffering);
-	if (dec->n_threads)
-		pthread_cond_signal(&dec->task_ready);
-	else
-		dec->worker_loop(dec);
+	
+	// publish the task, after which it belongs to workers
+	__atomic_or_fetch(&dec->busy_tasks, 1ull << task_id, __ATOMIC_RELAXED);
+	if (dec->n_threads) {
+		__atomic_or_fetch(&dec->pending_tasks, 1ull << task_id, __ATOMIC_RELEASE);
+		wake_workers(dec->pool);
+	} else {
+		dec->run_task(dec, task_id, -1);
+	}
 	return ret;
 }
 
@@ -1956,6 +2659,9 @@ int ADD_VARIANT(parse_seq_parameter_set)(Edge264Decoder *dec, Edge264UnrefCb unr
 	} else {
 		sps.max_num_reorder_frames = sps.max_dec_frame_buffering = MaxDpbFrames;
 	}
+	// output order is decoding order with pic_order_cnt_type 2 (8.2.1.3), so frames can be output as soon as they are decoded
+	if (sps.pic_order_cnt_type == 2)
+		sps.max_num_reorder_frames = 0;
 	log_dec(dec, "  max_num_ref_frames: %u\n"
 		"  gaps_in_frame_num_value_allowed_flag: %u\n"
 		"  pic_size_in_mbs: {width: %u, height: %u}\n"
@@ -2042,16 +2748,11 @@ int ADD_VARIANT(parse_seq_parameter_set)(Edge264Decoder *dec, Edge264UnrefCb unr
 				if (!(dec->out.stride_C & 4095)) // add an offset to stride if it is a multiple of 4096
 					dec->out.stride_C += (sps.chroma_format_idc == 3 ? 16 : 8) << (sps.BitDepth_C > 8);
 			}
+			dec->out.interleaved_CbCr = dec->nv12 && sps.chroma_format_idc > 0;
 			dec->plane_size_Y = dec->out.stride_Y * height;
 			dec->plane_size_C = dec->out.stride_C * (sps.chroma_format_idc == 1 ? height >> 1 : height);
 			dec->frame_flip_bits = 0;
-			for (int i = 0; i < 32; i++) {
-				if (dec->samples_buffers[i] != NULL) {
-					dec->free_cb(dec->samples_buffers[i], dec->mb_buffers[i], dec->alloc_arg);
-					dec->samples_buffers[i] = NULL;
-					dec->mb_buffers[i] = NULL;
-				}
-			}
+			spare_frames(dec, &sps);
 		}
 		*((dec->nal_unit_type == 7) ? &dec->sps : &dec->ssps) = sps;
 	}
@@ -1092,6 +1092,33 @@ static void decode_inter_chroma(int w, int h, size_t sstride, const uint8_t *src
 
 
 
+/**
+ * Block until next_deblock_addr of a reference frame reaches a minimum value,
+ * parking on the value itself which is unparked at each update. With no
+ * threads all references are complete before a slice starts, so we never wait.
+ * The wait is also abandoned when edge264_flush interrupts all tasks.
+ */
+static noinline void wait_ref_progress(Edge264Context *ctx, int pic, int addr) {
+	int32_t progress;
+	while (ctx->thread_id >= 0 && (progress = __atomic_load_n(&ctx->d->next_deblock_addr[pic], __ATOMIC_ACQUIRE)) < addr &&
+	       !__atomic_load_n(&ctx->d->cancel_tasks, __ATOMIC_ACQUIRE))
+		park(ctx->d->pool, &ctx->d->next_deblock_addr[pic], progress);
+}
+
+/**
+ * Make sure that all reference samples up to a luma row (margin included) are
+ * final. Since deblocking an mb modifies the bottom rows of mbB, row mby of a
+ * reference frame is complete when row mby+1 has been deblocked.
+ */
+static always_inline void wait_ref_rows(Edge264Context *ctx, int pic, int yInt_Y) {
+	int mby = min(max(yInt_Y, 0) >> 4, ctx->t.pic_height_in_mbs - 1);
+	int addr = min((mby + 2) * ctx->t.pic_width_in_mbs, ctx->t.pic_width_in_mbs * ctx->t.pic_height_in_mbs);
+	if (__builtin_expect(__atomic_load_n(&ctx->d->next_deblock_addr[pic], __ATOMIC_ACQUIRE) < addr, 0))
+		wait_ref_progress(ctx, pic, addr);
+}
+
+
+
 /**
  * Decode a single Inter block, fetching refIdx and mv at the given index in
  * memory, then computing the samples for the three color planes.
@@ -1109,12 +1136,19 @@ static void noinline decode_inter(Edge264Context *ctx, int i, int w, int h) {
 	static int8_t shift_Y_8bit[46] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15};
 	static int8_t shift_C_8bit[22] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 7, 7, 7, 7, 7, 7, 7};
 	
+	// with a reconstruction stage, defer the block since mvs stay in mb
+	if (__builtin_expect(ctx->rec != NULL, 0)) {
+		*ctx->rec++ = REC_INTER | i << 8 | w << 16 | h << 24;
+		return;
+	}
+	
 	// load motion vector and source pointers
 	int x = mb->mvs[i * 2];
 	int y = mb->mvs[i * 2 + 1];
 	int i8x8 = i >> 2;
 	int i4x4 = i & 15;
-	const uint8_t *ref = ctx->t.samples_buffers[mb->refPic[i8x8]];
+	int refPic = mb->refPic[i8x8];
+	const uint8_t *ref = ctx->t.samples_buffers[refPic];
 	int xInt_Y = ctx->mbx * 16 + x444[i4x4] + (x >> 2);
 	int xInt_C = ctx->mbx * 8 + (x444[i4x4] >> 1) + (x >> 3);
 	int yInt_Y = ctx->mby * 16 + y444[i4x4] + (y >> 2);
@@ -1125,6 +1159,9 @@ static void noinline decode_inter(Edge264Context *ctx, int i, int w, int h) {
 	size_t sstride_C = ctx->t.stride[1] >> 1;
 	// print_header(ctx->d, "<k></k><v>CurrMbAddr=%d, i=%d, w=%d, h=%d, x=%d, y=%d, idx=%d, pic=%d</v>\n", ctx->CurrMbAddr, i, w, h, x, y, mb->refIdx[i8x8], mb->refPic[i8x8]);
 	
+	// wait for the lowest row read by the 6-tap filter (and chroma overread)
+	wait_ref_rows(ctx, refPic, yInt_Y + h + 3);
+	
 	// prefetch source data into L3 cache
 	const uint8_t *pref_C = src_C;
 	for (int y = h + 1; y-- > 0; pref_C += sstride_C) {
@@ -5,9 +5,13 @@
 #ifndef edge264_COMMON_H
 #define edge264_COMMON_H
 
+#ifdef __linux__
+	#define _GNU_SOURCE // for pthread_attr_setaffinity_np
+#endif
 #include <assert.h>
 #include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -21,6 +25,13 @@
 	#include <unistd.h>
 	#include <sys/resource.h>
 #endif
+#ifdef __linux__
+	#include <dirent.h>
+	#include <linux/futex.h>
+	#include <linux/mempolicy.h>
+	#include <sys/mman.h>
+	#include <sys/syscall.h>
+#endif
 
 // Automatic selection of SIMD backend if not defined by environment
 #define SSE 1
@@ -150,6 +161,21 @@ static Edge264Macroblock unavail_mb = {
 	.Intra4x4PredMode = {-2, -2, -2, -2, -2, -2, -2, -2, -2, -2, -2, -2, -2, -2, -2, -2},
 };
 
+/**
+ * Dense copy of the motion of each macroblock, stored after the macroblocks
+ * of a frame (with the same indices) such that direct prediction in B slices
+ * with direct_8x8_inference_flag reads a single cache line per co-located
+ * macroblock. Only the mvs of the corner 4x4 blocks are kept (8.4.1.2.1), so
+ * the field is only allocated with this flag.
+ */
+typedef struct {
+	union { int8_t refIdx[8]; int32_t refIdx_s[2]; int64_t refIdx_l; }; // [LX][i8x8]
+	union { int8_t refPic[8]; int32_t refPic_s[2]; int64_t refPic_l; }; // [LX][i8x8]
+	union { int16_t mvs[16]; int32_t mvs_s[8]; i16x8 mvs_v[2]; }; // [LX][i8x8][compIdx]
+	uint32_t inter_eqs_s; // same as mb->f
+	uint32_t padding[3]; // to a 64-byte cache line
+} Edge264MbMotion;
+
 
 
 /**
@@ -236,7 +262,10 @@ typedef struct {
 	int8_t direct_8x8_inference_flag; // 0..1
 	int8_t cabac_init_idc; // 0..3
 	int8_t next_deblock_idc; // -1..31, -1 if next_deblock_addr is not written back to dec, currPic otherwise
+	int8_t stage_task; // -1..63, task deblocking or reconstructing this slice behind its parsing, -1 if done inline
+	int8_t stage; // 0..2, STAGE_DEBLOCK or STAGE_RECON for the task following a slice, 0 for the slice itself
 	int8_t frame_flip_bit; // 0..1
+	int8_t mb_window; // 0..1, mbs are stored in the MB_WINDOW_ROWS rows of mb_buffer rather than the whole frame
 	int16_t pic_width_in_mbs; // 0..1023
 	int16_t pic_height_in_mbs; // 0..1055
 	uint16_t stride[3]; // 0..65472 (at max width, 16bit & field pic), [iYCbCr]
@@ -251,6 +280,8 @@ typedef struct {
 	void *unref_arg; // copy from decode_NAL
 	Edge264Macroblock *mb_buffer;
 	Edge264Macroblock *mbCol_buffer;
+	Edge264MbMotion *motion_buffer;
+	Edge264MbMotion *motionCol_buffer;
 	uint8_t *samples_buffers[32];
 	union { uint16_t samples_clip[3][8]; i16x8 samples_clip_v[3]; }; // [iYCbCr], maximum sample value
 	union { int8_t RefPicList[2][32]; int64_t RefPicList_l[8]; i8x16 RefPicList_v[4]; };
@@ -319,6 +350,12 @@ typedef struct Edge264Context {
 	union { int8_t QP_C[2][64]; i8x16 QP_C_v[8]; };
 	union { int32_t c[64]; i32x4 c_v[16]; i32x8 c_V[8]; }; // non-scaled residual coefficients
 	
+	// Reconstruction stage context
+	int32_t *rec; // next word to record in the slot of the current mb, NULL when decoding samples directly
+	int32_t *rec_slot; // slot of the current mb in the ring of recorded operations
+	int32_t *rec_ring; // first slot of the ring
+	int32_t *rec_ring_end; // end of the last slot
+	
 	// Deblocking context
 	union { uint8_t alpha[16]; int32_t alpha_s[4]; i8x16 alpha_v; }; // {internal_Y,internal_Cb,internal_Cr,0,0,0,0,0,left_Y,left_Cb,left_Cr,0,top_Y,top_Cb,top_Cr,0}
 	union { uint8_t beta[16]; int32_t beta_s[4]; i8x16 beta_v; };
@@ -385,11 +422,76 @@ typedef struct Edge264Context {
  * _ number of frames waiting in the output queue (max_output_latency)
  */
 typedef int (*Parser)(Edge264Decoder *dec, Edge264UnrefCb unref_cb, void *unref_arg);
+typedef int (*TaskRunner)(Edge264Decoder *dec, int task_id, int thread_id);
+
+
+
+/**
+ * Worker threads are owned by a pool, either private to a decoder or shared
+ * between many decoders with edge264_pool_alloc. Each decoder keeps tracking
+ * its own task dependencies, while the pool visits decoders in round-robin
+ * order to pick ready tasks, so that streams share workers fairly.
+ * 
+ * Workers read the list of decoders and claim tasks without locking. Threads
+ * changing the list hold pool->lock, and before freeing anything a worker may
+ * still see, wait until every worker visiting decoders has left them, which
+ * each one signals in its scans word.
+ */
+typedef struct Edge264Pool {
+	pthread_mutex_t lock; // serializes changes to the list of decoders, workers never take it
+	pthread_mutex_t park_lock; // fallback for park/unpark without futexes
+	pthread_cond_t park_cond;
+	int8_t n_threads;
+	int8_t stop_workers; // makes workers exit when they next look for a task
+	int16_t numa_node; // node of all the CPUs given to edge264_pool_alloc, to bind frame buffers to, -1 if none or several
+	uint32_t task_seq; // incremented when tasks may have become ready, to unpark idle workers
+	int32_t parked_workers; // number of idle workers parked on task_seq, to skip waking them if none is
+	int32_t spin_count; // iterations polling task_seq before idle workers park, 0 to park right away
+	uint32_t spin_hits; // times an idle worker saw new tasks while polling
+	uint32_t spin_misses; // times it had to park after polling
+	int8_t syncing; // set while a thread waits in wait_scans or for pool_holds, so that workers signal sync_seq
+	uint32_t sync_seq; // incremented by workers leaving decoders while syncing is set
+	uint32_t next_decoder; // incremented by each worker looking for a task, to start from the next decoder
+	int n_decoders; // number of slots used in decoders, some of which may be NULL after detaching
+	int decoders_size; // number of slots allocated in decoders
+	Edge264Decoder **decoders; // replaced when full, the previous array being freed once no worker visits it
+	uint32_t scans[64][16] __attribute__((aligned(64))); // for each worker on its own cache line, odd while visiting decoders
+	pthread_t threads[64];
+} Edge264Pool;
+
+
+
+/**
+ * Frame buffers released by a change of frame format are kept as spares, if
+ * they fit frames of the new format, until the next change of format.
+ */
+typedef struct {
+	uint8_t *samples;
+	Edge264Macroblock *mbs;
+	uint32_t samples_size; // bytes allocated, rounded up to a size class
+	uint32_t mbs_size;
+} Edge264Buffer;
+
+
+
+#define DEBLOCKED_RANGES 16 // completed slices each frame may record ahead of its deblocking progress
+#define MB_WINDOW_ROWS 4 // rows of mbs kept for non-reference pictures with EDGE264_MB_WINDOW, the last 2 moving to the top when full
 typedef struct Edge264Decoder {
 	// minimal set of fields preserved across flushes
 	Edge264GetBits gb; // must be first in the struct to use the same pointer for bitstream functions
-	int8_t n_threads; // 0 to disable multithreading
+	int8_t n_threads; // number of workers in pool, 0 to disable multithreading
+	uint64_t task_slots; // bitmask for the slots of tasks that may be used, sized with the number of workers
 	int8_t max_output_latency; // number of frames in output_queue to suspend decoding of new frames, 0..16
+	int8_t fifo_tasks; // run ready tasks in decoding order rather than critical path first
+	int8_t deblock_stage; // deblock slices on a second worker rather than inline
+	int8_t recon_stage; // reconstruct the samples of slices starting a frame on a second worker
+	int8_t caller_tasks; // run ready tasks in the thread calling the API while it waits for workers
+	int8_t nv12; // interleave the chroma planes of complete frames for output
+	int8_t mb_window; // decode non-reference pictures in mb_window_buffer when single-threaded
+	int8_t internal_alloc; // frames are allocated by edge264 rather than alloc_cb, and may be bound to the NUMA node of the pool
+	int8_t max_workers; // limit on workers running tasks of this decoder at once, 0 to scale automatically
+	int8_t auto_workers; // workers needed for the picture size, plus one each time the parser ran out of task slots
+	int8_t parser_stalled; // whether the parser ran out of task slots since the last frame
 	int8_t nal_unit_type; // 5 significant bits
 	int32_t plane_size_Y;
 	int32_t plane_size_C;
@@ -398,15 +500,29 @@ typedef struct Edge264Decoder {
 	Edge264AllocCb alloc_cb;
 	Edge264FreeCb free_cb;
 	void *alloc_arg;
-	void *(*worker_loop)(void *);
+	Edge264FrameCb frame_cb; // called from any thread when edge264_get_frame may return a frame
+	void *frame_arg;
+	TaskRunner run_task;
 	uint8_t *samples_buffers[32];
 	Edge264Macroblock *mb_buffers[32];
+	uint32_t samples_sizes[32]; // bytes allocated for samples_buffers, which may exceed the current frame format
+	uint32_t mb_sizes[32];
+	int8_t n_spare_buffers;
+	Edge264Buffer spare_buffers[32];
+	uint32_t allocated_buffers; // number of frames allocated with alloc_cb
+	uint32_t reused_buffers; // number of frames taken from spare_buffers
 	Parser parse_nal_unit[32];
-	pthread_t threads[16];
-	pthread_mutex_t lock;
-	pthread_cond_t task_ready;
-	pthread_cond_t task_progress; // signals next_deblock_addr has been updated
-	pthread_cond_t task_complete;
+	int32_t *recon_rings[64]; // for reconstruction tasks, ring of operations recorded by their slice
+	int32_t *recon_rows[64]; // for reconstruction tasks, number of mbs reconstructed in each row, stored after their ring
+	int32_t recon_ring_sizes[64]; // number of words allocated in recon_rings
+	Edge264Macroblock *mb_window_buffer; // rows of mbs for non-reference pictures with EDGE264_MB_WINDOW, or a whole frame of them after a spill
+	int32_t mb_window_size; // number of mbs allocated in mb_window_buffer
+	pthread_mutex_t lock; // serializes calls to the API, released while the parser waits for workers, workers never take it
+	pthread_mutex_t parse_lock; // serializes edge264_decode_NAL and edge264_flush, kept while they wait for workers
+	Edge264Pool *pool; // workers running the tasks, NULL without multithreading
+	pthread_mutex_t merge_lock; // serializes merge_deblocked_slice between workers
+	int8_t own_pool; // whether pool was created by edge264_alloc and should be freed along
+	int32_t pool_holds; // number of workers between claiming a task and completing it
 	Edge264Frame out;
 	
 	// general contextual fields
@@ -436,6 +552,8 @@ typedef struct Edge264Decoder {
 	uint32_t to_get_frames; // bitfield for frames that have not been returned by get_frame yet
 	uint32_t output_frames; // bitfield for frames that have entered output_queue
 	uint32_t non_base_frames; // bitfield for frames that are non-base views in MVC
+	uint32_t window_frames; // bitfield for frames decoding their mbs in mb_window_buffer
+	uint32_t spilled_frames; // bitfield for frames that left their window of mb rows for a whole frame of mbs in mb_window_buffer
 	int32_t FrameNums[32]; // signed to be used along FieldOrderCnt in initial reference ordering
 	int32_t FrameIds[32]; // unique identifiers for each frame, incremented in decoding order
 	union { int8_t output_queue[2][32]; i8x16 output_queue_v[2][2]; }; // FIFO with insertion at 0 for both views, and empty slots having value -1
@@ -444,14 +562,28 @@ typedef struct Edge264Decoder {
 	union { int32_t FieldOrderCnt[2][32]; i32x4 FieldOrderCnt_v[2][8]; }; // lower/higher half for top/bottom fields
 	int32_t remaining_mbs[32] __attribute__((aligned(64))); // when 0 all mbs have been decoded yet not deblocked
 	union { int32_t next_deblock_addr[32]; i32x4 next_deblock_addr_v[8]; }; // next CurrMbAddr value for which mbB will be deblocked, when INT_MAX the picture is complete
+	int8_t deblocked_slices[32]; // number of ranges recorded in deblocked_ranges for each frame
+	int32_t deblocked_ranges[32][DEBLOCKED_RANGES][2]; // {first_mb_in_slice, end} of slices completed ahead of next_deblock_addr, merged when it reaches them
 	
 	// fields accessed concurrently from multiple threads
-	uint16_t pending_tasks;
-	uint16_t busy_tasks; // bitmask for tasks that are either pending or processed in a thread
-	uint16_t ready_tasks;
-	volatile union { uint32_t task_dependencies[16]; i32x4 task_dependencies_v[4]; }; // frames on which each task depends to start
-	union { int8_t taskPics[16]; i8x16 taskPics_v; }; // values of currPic for each task
-	Edge264Task tasks[16];
+	uint64_t pending_tasks; // bitmask for tasks waiting for a worker, cleared atomically to reserve one
+	uint64_t busy_tasks; // bitmask for tasks that are either pending or processed in a thread
+	uint32_t task_releases; // incremented when tasks release their slots, to unpark the parser waiting for them
+	int8_t cancel_tasks; // set by edge264_flush to end running slices at their next row
+	uint32_t output_heads; // frames at the head of output_queue plus 1 (0 if empty) in bytes 0/1 for both views, whether MVC in bit 16, and output_count in byte 3
+	uint8_t output_count; // number of frames returned by edge264_get_frame, modulo 256
+	uint8_t notified_frames; // number of frames signaled to frame_cb, modulo 256, advanced by compare-and-swap to signal each one once
+	volatile union { uint32_t task_dependencies[64]; i32x4 task_dependencies_v[16]; }; // frames referenced by each task, kept from reuse until it completes
+	union { int8_t taskPics[64]; i8x16 taskPics_v[4]; }; // values of currPic for each task
+	uint64_t task_gens[8]; // 8-bit counters for each task, incremented when its slot is filled again, for claim_task to detect reuse
+	int32_t decoded_mbs[64]; // for deblocking and reconstruction tasks, next CurrMbAddr of their slice published at row ends, bitwise negated when it completes
+	int16_t decoded_results[64]; // for deblocking and reconstruction tasks, return code of their slice
+	int32_t reconstructed_mbs[64]; // for reconstruction tasks, next CurrMbAddr to reconstruct, published at row ends
+	int32_t recon_ring_mbs[64]; // number of slots in recon_rings
+	int32_t recon_next_row[64]; // for reconstruction tasks, next row to be claimed by the group
+	int8_t recon_active[64]; // for reconstruction tasks, number of tasks of the group that did not exit yet
+	uint64_t stage_groups[64]; // tasks following a slice, indexed by its stage_task
+	Edge264Task tasks[64];
 	
 	// Logging context
 	uint64_t log_base_us; // timestamp of decoder initialization
@@ -463,6 +595,36 @@ typedef struct Edge264Decoder {
 
 
 
+/**
+ * State shared by the threads of edge264_decode_gops. Each one owns a decoder
+ * attached to the pool, claims the next GOP by scanning the stream up to the
+ * following IDR picture, and holds its frames until the GOPs before it were
+ * output.
+ */
+typedef struct Edge264Gops {
+	pthread_mutex_t lock; // protects the fields below, except output_cb and output_arg
+	pthread_cond_t turn_cond; // signaled when output_gop or failed_gop change
+	Edge264Pool *pool;
+	int flags;
+	Edge264OutputCb output_cb; // called by the thread of output_gop only
+	void *output_arg;
+	const uint8_t *next_nal; // first NAL of the next GOP to claim
+	const uint8_t *end;
+	const uint8_t *params[6][2]; // {buf, end} of the SPS, subset SPS and PPS 0..3 before next_nal in stream order, replayed to each new GOP
+	int n_params;
+	int n_gops; // number of GOPs claimed so far
+	int output_gop; // index of the GOP allowed to output frames
+	int failed_gop; // index of the first GOP that failed, INT_MAX if none
+	int failed_ret; // return code of failed_gop
+} Edge264Gops;
+typedef struct {
+	Edge264Gops *gops;
+	Edge264Decoder *dec;
+	pthread_t thread;
+} Edge264GopThread;
+
+
+
 #if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
 	#error "Little-endian CPU required at the moment until requested and testable"
 #endif
@@ -635,6 +797,48 @@ enum IntraChromaModes {
 
 
 
+/**
+ * A slice may be followed by a second task that deblocks it, or by a group
+ * of tasks that reconstruct it behind its parsing. For reconstruction, the
+ * slice records the sample operations of each mb in a slot of REC_SLOT_WORDS
+ * words, which the group replays row by row in a wavefront. A slot starts with its size in words and
+ * the QP of its mb. Each operation then has a word {op, iYCbCr, arg, 0}, the
+ * offset of its block from samples_mb[iYCbCr], and the coefficients it
+ * consumes, except REC_INTER which packs {op, i, w, h} in a single word.
+ * The largest mb in 4:2:0 (Intra4x4 with all blocks coded) needs 492 words.
+ * PCM samples need no prediction, so they are still written while parsing.
+ */
+enum TaskStages {
+	STAGE_DEBLOCK = 1,
+	STAGE_RECON,
+};
+
+enum RecordedOps {
+	REC_INTER,
+	REC_INTRA4x4,
+	REC_INTRA8x8,
+	REC_INTRA16x16,
+	REC_INTRA_CHROMA,
+	REC_IDCT4x4, // 16 coefficients then the DC value if arg >= 0
+	REC_DC4x4, // DC value
+	REC_IDCT8x8, // 64 coefficients
+	REC_DC16x16, // 16 DC values in raster order
+	REC_DC8x8, // 4 Cb then 4 Cr DC values
+};
+#define REC_SLOT_WORDS 512
+#define REC_RING_ROWS 4
+#define MBS_PER_WORKER 1024 // picture size that keeps one worker busy when scaling them automatically
+
+static always_inline int32_t *record_op(Edge264Context *ctx, int op, int iYCbCr, int arg, const uint8_t *p, int payload) {
+	int32_t *rec = ctx->rec;
+	rec[0] = op | iYCbCr << 8 | (arg & 255) << 16;
+	rec[1] = p - ctx->samples_mb[iYCbCr];
+	ctx->rec = rec + 2 + payload;
+	return rec + 2;
+}
+
+
+
 /**
  * These macros account for the differences in offset addressing between
  * architectures, whether or not they can add and scale a stride to a pointer
@@ -1208,21 +1412,92 @@ static unsigned refs_to_mask(Edge264Task *t) {
 	u32x4 e = d | (u32x4)shr128(d, 8);
 	return e[0];
 }
-static always_inline unsigned ready_frames(Edge264Decoder *dec) {
-	i32x4 last = set32(INT_MAX);
-	i16x8 a = packs32(dec->next_deblock_addr_v[0] == last, dec->next_deblock_addr_v[1] == last);
-	i16x8 b = packs32(dec->next_deblock_addr_v[2] == last, dec->next_deblock_addr_v[3] == last);
-	i16x8 c = packs32(dec->next_deblock_addr_v[4] == last, dec->next_deblock_addr_v[5] == last);
-	i16x8 d = packs32(dec->next_deblock_addr_v[6] == last, dec->next_deblock_addr_v[7] == last);
-	return movemask(packs16(a, b)) | movemask(packs16(c, d)) << 16;
+static always_inline unsigned pending_frames(Edge264Decoder *dec, uint64_t pending) {
+	unsigned frames = 0;
+	for (uint64_t p = pending; p; p &= p - 1) {
+		int pic = __atomic_load_n(&dec->taskPics[__builtin_ctzll(p)], __ATOMIC_RELAXED);
+		if (pic >= 0) // -1 for a slot released since pending was read
+			frames |= 1u << pic;
+	}
+	return frames;
+}
+// a task may start once all slices of its references have started, then waits on rows
+static always_inline uint64_t ready_tasks(Edge264Decoder *dec) {
+	uint64_t pending_tasks = __atomic_load_n(&dec->pending_tasks, __ATOMIC_ACQUIRE);
+	i32x4 pending = set32(pending_frames(dec, pending_tasks));
+	uint64_t ready = 0;
+	for (int i = 0; i < 64 && pending_tasks >> i; i += 16) {
+		i32x4 a = (dec->task_dependencies_v[i / 4 + 0] & pending) == 0;
+		i32x4 b = (dec->task_dependencies_v[i / 4 + 1] & pending) == 0;
+		i32x4 c = (dec->task_dependencies_v[i / 4 + 2] & pending) == 0;
+		i32x4 d = (dec->task_dependencies_v[i / 4 + 3] & pending) == 0;
+		ready |= (uint64_t)movemask(packs16(packs32(a, b), packs32(c, d))) << i;
+	}
+	return pending_tasks & ready;
+}
+// number of workers that may run tasks of a decoder at once
+static inline int worker_budget(Edge264Decoder *dec) {
+	return __atomic_load_n(&dec->max_workers, __ATOMIC_RELAXED) ?: __atomic_load_n(&dec->auto_workers, __ATOMIC_RELAXED);
+}
+// tasks continuing started slices, which run beyond worker_budget since tasks waiting on their frames hold it
+static inline uint64_t stage_tasks(Edge264Decoder *dec, uint64_t tasks) {
+	uint64_t stage = 0;
+	for (uint64_t t = tasks; t; t &= t - 1)
+		stage |= (uint64_t)(dec->tasks[__builtin_ctzll(t)].stage != 0) << __builtin_ctzll(t);
+	return stage;
+}
+// critical path first (frames other tasks reference, then decoding order, then largest slices), or plain decoding order with EDGE264_FIFO_TASKS
+static inline int select_task(Edge264Decoder *dec, uint64_t ready) {
+	uint64_t candidates = ready;
+	if (!dec->fifo_tasks) {
+		unsigned waited = 0;
+		for (uint64_t b = __atomic_load_n(&dec->busy_tasks, __ATOMIC_RELAXED); b; b &= b - 1)
+			waited |= __atomic_load_n(&dec->task_dependencies[__builtin_ctzll(b)], __ATOMIC_RELAXED);
+		uint64_t critical = 0;
+		for (uint64_t r = ready; r; r &= r - 1)
+			critical |= (uint64_t)(waited >> (__atomic_load_n(&dec->taskPics[__builtin_ctzll(r)], __ATOMIC_RELAXED) & 31) & 1) << __builtin_ctzll(r);
+		if (critical)
+			candidates = critical;
+	}
+	int best = __builtin_ctzll(candidates);
+	for (uint64_t c = candidates & (candidates - 1); c; c &= c - 1) {
+		int i = __builtin_ctzll(c);
+		int32_t order = dec->tasks[i].FrameId - dec->tasks[best].FrameId;
+		if (order < 0 || (order == 0 && (dec->fifo_tasks ?
+		    dec->tasks[i].first_mb_in_slice < dec->tasks[best].first_mb_in_slice :
+		    dec->tasks[i].gb.end - dec->tasks[i].gb.CPB > dec->tasks[best].gb.end - dec->tasks[best].gb.CPB)))
+			best = i;
+	}
+	return best;
 }
-static always_inline unsigned ready_tasks(Edge264Decoder *dec) {
-	i32x4 not_ready = ~set32(ready_frames(dec));
-	i32x4 a = (dec->task_dependencies_v[0] & not_ready) == 0;
-	i32x4 b = (dec->task_dependencies_v[1] & not_ready) == 0;
-	i32x4 c = (dec->task_dependencies_v[2] & not_ready) == 0;
-	i32x4 d = (dec->task_dependencies_v[3] & not_ready) == 0;
-	return dec->pending_tasks & movemask(packs16(packs32(a, b), packs32(c, d)));
+// bump the generation of a task slot, before it is made pending again
+static inline void renew_task(Edge264Decoder *dec, int task_id) {
+	__atomic_fetch_add(&dec->task_gens[task_id >> 3], 1ull << (task_id & 7) * 8, __ATOMIC_RELAXED);
+}
+/**
+ * Reserve a ready task by clearing its pending bit, returns -1 if none is
+ * ready. If the slot was released and filled again between ready_tasks and
+ * clearing the bit, the readiness we computed belonged to its previous task,
+ * so we give the bit back and try again. Carries between counters only cause
+ * extra tries.
+ */
+static inline int claim_task(Edge264Decoder *dec, int stage_only) {
+	for (;;) {
+		uint64_t gens[8];
+		for (int i = 0; i < 8; i++)
+			gens[i] = __atomic_load_n(&dec->task_gens[i], __ATOMIC_ACQUIRE);
+		uint64_t ready = ready_tasks(dec);
+		if (!ready || (stage_only && !(ready = stage_tasks(dec, ready))))
+			return -1;
+		int task_id = select_task(dec, ready);
+		uint64_t bit = 1ull << task_id;
+		if (!(__atomic_fetch_and(&dec->pending_tasks, ~bit, __ATOMIC_ACQ_REL) & bit))
+			continue;
+		uint64_t gen = __atomic_load_n(&dec->task_gens[task_id >> 3], __ATOMIC_ACQUIRE);
+		if ((uint8_t)(gen >> (task_id & 7) * 8) == (uint8_t)(gens[task_id >> 3] >> (task_id & 7) * 8))
+			return task_id;
+		__atomic_or_fetch(&dec->pending_tasks, bit, __ATOMIC_RELEASE);
+	}
 }
 static inline unsigned dpb_frames(Edge264Decoder *dec) {
 	return dec->prev_short_term_frames | dec->prev_long_term_frames | dec->to_get_frames & ~dec->output_frames;
@@ -1231,12 +1506,81 @@ static inline unsigned unavail_frames(Edge264Decoder *dec) {
 	return dec->prev_short_term_frames | dec->prev_long_term_frames | dec->to_get_frames | dec->output_frames;
 }
 static inline unsigned depended_frames(Edge264Decoder *dec) {
-	u32x4 a = dec->task_dependencies_v[0] | dec->task_dependencies_v[1] |
-	          dec->task_dependencies_v[2] | dec->task_dependencies_v[3];
+	i32x4 v = {};
+	for (int i = 0; i < 16; i++)
+		v |= dec->task_dependencies_v[i];
+	u32x4 a = (u32x4)v;
 	u32x4 b = a | (u32x4)shr128(a, 8);
 	u32x4 c = b | (u32x4)shr128(b, 4);
 	return c[0];
 }
+// futex-style wait while a 32-bit word equals val (may return spuriously), and wakeup of all its waiters
+static inline void park(Edge264Pool *pool, void *word, int32_t val) {
+	#ifdef __linux__
+		syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+	#else
+		pthread_mutex_lock(&pool->park_lock);
+		if (__atomic_load_n((int32_t *)word, __ATOMIC_ACQUIRE) == val)
+			pthread_cond_wait(&pool->park_cond, &pool->park_lock);
+		pthread_mutex_unlock(&pool->park_lock);
+	#endif
+}
+static inline void unpark(Edge264Pool *pool, void *word) {
+	#ifdef __linux__
+		syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+	#else
+		pthread_mutex_lock(&pool->park_lock);
+		pthread_cond_broadcast(&pool->park_cond);
+		pthread_mutex_unlock(&pool->park_lock);
+	#endif
+}
+// signal idle workers that tasks may have become ready, skipping the syscall if none of them is parked
+static inline void wake_workers(Edge264Pool *pool) {
+	__atomic_add_fetch(&pool->task_seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pool->parked_workers, __ATOMIC_SEQ_CST))
+		unpark(pool, &pool->task_seq);
+}
+// hint the CPU that we are polling a memory location
+static always_inline void spin_pause(void) {
+	#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+	#elif defined(__aarch64__)
+		__asm__ volatile("yield");
+	#endif
+}
+// wait until a progress word reaches val, flagging it so that signal_progress only wakes up a waiting thread
+#define PROGRESS_WAITING (1 << 30)
+static inline void wait_progress(Edge264Pool *pool, int32_t *word, int32_t val) {
+	for (int32_t v; ((v = __atomic_load_n(word, __ATOMIC_ACQUIRE)) & ~PROGRESS_WAITING) < val; ) {
+		if ((v & PROGRESS_WAITING) || __atomic_compare_exchange_n(word, &v, v | PROGRESS_WAITING, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			park(pool, word, v | PROGRESS_WAITING);
+	}
+}
+static inline void signal_progress(Edge264Pool *pool, int32_t *word, int32_t val) {
+	if (__atomic_exchange_n(word, val, __ATOMIC_RELEASE) & PROGRESS_WAITING)
+		unpark(pool, word);
+}
+// publish the heads of output_queue for notify_frame_ready, with dec->lock held wherever the queue changes
+static inline void publish_output_heads(Edge264Decoder *dec) {
+	int idx0 = __builtin_ctzg(movemask(dec->output_queue_v[0][0]) | movemask(dec->output_queue_v[0][1]) << 16, 32) - 1;
+	int idx1 = __builtin_ctzg(movemask(dec->output_queue_v[1][0]) | movemask(dec->output_queue_v[1][1]) << 16, 32) - 1;
+	uint32_t heads = (idx0 >= 0 ? dec->output_queue[0][idx0] + 1 : 0) |
+		(idx1 >= 0 ? dec->output_queue[1][idx1] + 1 : 0) << 8 | (dec->ssps.BitDepth_Y != 0) << 16 | (uint32_t)dec->output_count << 24;
+	__atomic_exchange_n(&dec->output_heads, heads, __ATOMIC_SEQ_CST); // pairs with the exchange completing a frame, so that at least one thread notifies
+}
+// signal the frame at the head of output_queue to frame_cb once it is complete, from workers too (thus without dec->lock, reading the queue from output_heads)
+static inline void notify_frame_ready(Edge264Decoder *dec) {
+	if (dec->frame_cb == NULL)
+		return;
+	uint32_t heads = __atomic_load_n(&dec->output_heads, __ATOMIC_SEQ_CST);
+	int pic0 = (heads & 255) - 1;
+	int pic1 = (heads >> 8 & 255) - 1;
+	uint8_t count = heads >> 24;
+	if (pic0 >= 0 && __atomic_load_n(&dec->next_deblock_addr[pic0], __ATOMIC_SEQ_CST) == INT_MAX &&
+	    (!(heads >> 16 & 1) || (pic1 >= 0 && __atomic_load_n(&dec->next_deblock_addr[pic1], __ATOMIC_SEQ_CST) == INT_MAX)) &&
+	    __atomic_compare_exchange_n(&dec->notified_frames, &count, count + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		dec->frame_cb(dec->frame_arg);
+}
 // relative time with microsecond precision
 static always_inline uint64_t get_relative_time_us() {
 	#ifdef _WIN32
@@ -1381,10 +1725,11 @@ static noinline void parse_slice_data_cabac(Edge264Context *ctx);
 #ifndef ADD_VARIANT
 	#define ADD_VARIANT(f) f
 #endif
-void *worker_loop(void *d);
-void *worker_loop_v2(void *d);
-void *worker_loop_v3(void *d);
-void *worker_loop_log(void *d);
+static noinline void wait_recon_room(Edge264Context *ctx);
+int run_task(Edge264Decoder *dec, int task_id, int thread_id);
+int run_task_v2(Edge264Decoder *dec, int task_id, int thread_id);
+int run_task_v3(Edge264Decoder *dec, int task_id, int thread_id);
+int run_task_log(Edge264Decoder *dec, int task_id, int thread_id);
 int ignore_NAL_log(Edge264Decoder *dec, Edge264UnrefCb unref_cb, void *unref_arg);
 int unsup_NAL_log(Edge264Decoder *dec, Edge264UnrefCb unref_cb, void *unref_arg);
 int parse_slice_layer_without_partitioning(Edge264Decoder *dec, Edge264UnrefCb unref_cb, void *unref_arg);
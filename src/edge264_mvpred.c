@@ -38,6 +38,21 @@ static always_inline i16x8 mvs_near_zero(i16x8 mvCol, i32x4 zero) {
 
 
 
+/**
+ * Copy the final motion of mb to the dense motion field of its frame, for
+ * later use as co-located macroblock.
+ */
+static always_inline void store_mb_motion(Edge264Context *ctx) {
+	Edge264MbMotion *m = ctx->t.motion_buffer + (mb - ctx->t.mb_buffer);
+	m->refIdx_l = mb->refIdx_l;
+	m->refPic_l = mb->refPic_l;
+	m->mvs_v[0] = (i32x4){mb->mvs_s[0], mb->mvs_s[5], mb->mvs_s[10], mb->mvs_s[15]};
+	m->mvs_v[1] = (i32x4){mb->mvs_s[16], mb->mvs_s[21], mb->mvs_s[26], mb->mvs_s[31]};
+	m->inter_eqs_s = mb->f.inter_eqs_s;
+}
+
+
+
 /**
  * Decoding of P_Skip is put in a function for reuse when recovering a P slice.
  */
@@ -329,19 +344,26 @@ static always_inline void decode_direct_spatial_mv_pred(Edge264Context *ctx, uns
 		i16x8 colZeroMask0 = {}, colZeroMask1 = {}, colZeroMask2 = {}, colZeroMask3 = {};
 		unsigned colZeroFlags = 0;
 		if (ctx->col_short_term) {
-			const Edge264Macroblock *mbCol = ctx->mbCol;
-			i8x16 refColL0 = (i32x4){mbCol->refIdx_s[0]};
-			i8x16 offsets = refColL0 & 32;
-			i16x8 mvCol0 = *(i16x8*)(mbCol->mvs + offsets[0]);
-			i16x8 mvCol1 = *(i16x8*)(mbCol->mvs + offsets[1] + 8);
-			i16x8 mvCol2 = *(i16x8*)(mbCol->mvs + offsets[2] + 16);
-			i16x8 mvCol3 = *(i16x8*)(mbCol->mvs + offsets[3] + 24);
-			i8x16 refCol = ifelse_msb(refColL0, (i32x4){mbCol->refIdx_s[1]}, refColL0);
+			i8x16 refCol;
+			i16x8 mvCol0, mvCol1, mvCol2, mvCol3;
 			if (ctx->t.direct_8x8_inference_flag) {
-				mvCol0 = broadcast32(mvCol0, 0);
-				mvCol1 = broadcast32(mvCol1, 1);
-				mvCol2 = broadcast32(mvCol2, 2);
-				mvCol3 = broadcast32(mvCol3, 3);
+				const Edge264MbMotion *col = ctx->t.motionCol_buffer + (ctx->mbCol - ctx->t.mbCol_buffer);
+				i8x16 refColL0 = (i32x4){col->refIdx_s[0]};
+				i8x16 offsets = (refColL0 < 0) & 4;
+				mvCol0 = set32(col->mvs_s[offsets[0]]);
+				mvCol1 = set32(col->mvs_s[offsets[1] + 1]);
+				mvCol2 = set32(col->mvs_s[offsets[2] + 2]);
+				mvCol3 = set32(col->mvs_s[offsets[3] + 3]);
+				refCol = ifelse_msb(refColL0, (i32x4){col->refIdx_s[1]}, refColL0);
+			} else {
+				const Edge264Macroblock *mbCol = ctx->mbCol;
+				i8x16 refColL0 = (i32x4){mbCol->refIdx_s[0]};
+				i8x16 offsets = refColL0 & 32;
+				mvCol0 = *(i16x8*)(mbCol->mvs + offsets[0]);
+				mvCol1 = *(i16x8*)(mbCol->mvs + offsets[1] + 8);
+				mvCol2 = *(i16x8*)(mbCol->mvs + offsets[2] + 16);
+				mvCol3 = *(i16x8*)(mbCol->mvs + offsets[3] + 24);
+				refCol = ifelse_msb(refColL0, (i32x4){mbCol->refIdx_s[1]}, refColL0);
 			}
 			
 			// initialize colZeroFlags and masks for motion vectors
@@ -444,22 +466,30 @@ static always_inline void decode_direct_spatial_mv_pred(Edge264Context *ctx, uns
 
 static always_inline void decode_direct_temporal_mv_pred(Edge264Context *ctx, unsigned direct_flags)
 {
-	// load refPicCol and mvCol
-	const Edge264Macroblock *mbCol = ctx->mbCol;
-	i8x16 refPicColL0 = (i32x4){mbCol->refPic_s[0]};
-	i8x16 offsets = refPicColL0 & 32;
-	i16x8 mvCol0 = *(i16x8*)(mbCol->mvs + offsets[0]);
-	i16x8 mvCol1 = *(i16x8*)(mbCol->mvs + offsets[1] + 8);
-	i16x8 mvCol2 = *(i16x8*)(mbCol->mvs + offsets[2] + 16);
-	i16x8 mvCol3 = *(i16x8*)(mbCol->mvs + offsets[3] + 24);
-	i8x16 refPicCol = ifelse_msb(refPicColL0, (i32x4){mbCol->refPic_s[1]}, refPicColL0);
-	unsigned inter_eqs = little_endian32(mbCol->f.inter_eqs_s);
+	// load refPicCol and mvCol, from the dense motion field with direct_8x8_inference_flag
+	i8x16 refPicCol;
+	i16x8 mvCol0, mvCol1, mvCol2, mvCol3;
+	unsigned inter_eqs;
 	if (ctx->t.direct_8x8_inference_flag) {
-		mvCol0 = broadcast32(mvCol0, 0);
-		mvCol1 = broadcast32(mvCol1, 1);
-		mvCol2 = broadcast32(mvCol2, 2);
-		mvCol3 = broadcast32(mvCol3, 3);
-		inter_eqs |= 0x1b1b1b1b;
+		const Edge264MbMotion *col = ctx->t.motionCol_buffer + (ctx->mbCol - ctx->t.mbCol_buffer);
+		i8x16 refPicColL0 = (i32x4){col->refPic_s[0]};
+		i8x16 offsets = (refPicColL0 < 0) & 4;
+		mvCol0 = set32(col->mvs_s[offsets[0]]);
+		mvCol1 = set32(col->mvs_s[offsets[1] + 1]);
+		mvCol2 = set32(col->mvs_s[offsets[2] + 2]);
+		mvCol3 = set32(col->mvs_s[offsets[3] + 3]);
+		refPicCol = ifelse_msb(refPicColL0, (i32x4){col->refPic_s[1]}, refPicColL0);
+		inter_eqs = little_endian32(col->inter_eqs_s) | 0x1b1b1b1b;
+	} else {
+		const Edge264Macroblock *mbCol = ctx->mbCol;
+		i8x16 refPicColL0 = (i32x4){mbCol->refPic_s[0]};
+		i8x16 offsets = refPicColL0 & 32;
+		mvCol0 = *(i16x8*)(mbCol->mvs + offsets[0]);
+		mvCol1 = *(i16x8*)(mbCol->mvs + offsets[1] + 8);
+		mvCol2 = *(i16x8*)(mbCol->mvs + offsets[2] + 16);
+		mvCol3 = *(i16x8*)(mbCol->mvs + offsets[3] + 24);
+		refPicCol = ifelse_msb(refPicColL0, (i32x4){mbCol->refPic_s[1]}, refPicColL0);
+		inter_eqs = little_endian32(mbCol->f.inter_eqs_s);
 	}
 	
 	// conditional memory storage
@@ -515,6 +545,11 @@ static always_inline void decode_direct_temporal_mv_pred(Edge264Context *ctx, un
 }
 
 static noinline void decode_direct_mv_pred(Edge264Context *ctx, unsigned direct_flags) {
+	// mbCol belongs to a frame that may still be decoding in another thread
+	int colPic = ctx->t.RefPicList[1][0];
+	int addr = (ctx->mby + 1) * ctx->t.pic_width_in_mbs;
+	if (__builtin_expect(__atomic_load_n(&ctx->d->next_deblock_addr[colPic], __ATOMIC_ACQUIRE) < addr, 0))
+		wait_ref_progress(ctx, colPic, addr);
 	if (ctx->t.direct_spatial_mv_pred_flag) {
 		decode_direct_spatial_mv_pred(ctx, direct_flags);
 	} else {
@@ -107,6 +107,15 @@ static const i8x16 normAdjust8x8[12] = {
  */
 static noinline void add_idct4x4(Edge264Context *ctx, int iYCbCr, int DCidx, uint8_t *p)
 {
+	// with a reconstruction stage, defer the block with its coefficients
+	if (__builtin_expect(ctx->rec != NULL, 0)) {
+		int32_t *rec = record_op(ctx, REC_IDCT4x4, iYCbCr, DCidx, p, 17);
+		memcpy(rec, ctx->c, 64);
+		rec[16] = DCidx >= 0 ? ctx->c[16 + DCidx] : 0;
+		ctx->c_v[0] = ctx->c_v[1] = ctx->c_v[2] = ctx->c_v[3] = (i8x16){};
+		return;
+	}
+	
 	// loading and scaling
 	unsigned qP = ctx->t.QP[iYCbCr];
 	int sh = qP / 6;
@@ -172,6 +181,10 @@ static noinline void add_idct4x4(Edge264Context *ctx, int iYCbCr, int DCidx, uin
 }
 
 static void add_dc4x4(Edge264Context *ctx, int iYCbCr, int DCidx, uint8_t *p) {
+	if (__builtin_expect(ctx->rec != NULL, 0)) {
+		*record_op(ctx, REC_DC4x4, iYCbCr, DCidx, p, 1) = ctx->c[16 + DCidx];
+		return;
+	}
 	i32x4 r = set16((ctx->c[16 + DCidx] + 32) >> 6);
 	size_t stride = ctx->t.stride[iYCbCr];
 	DECL_SSTRIDE(stride);
@@ -193,6 +206,13 @@ static void add_dc4x4(Edge264Context *ctx, int iYCbCr, int DCidx, uint8_t *p) {
  */
 static void add_idct8x8(Edge264Context *ctx, int iYCbCr, uint8_t *dst0)
 {
+	if (__builtin_expect(ctx->rec != NULL, 0)) {
+		memcpy(record_op(ctx, REC_IDCT8x8, iYCbCr, 0, dst0, 64), ctx->c, 256);
+		for (int i = 0; i < 16; i++)
+			ctx->c_v[i] = (i32x4){};
+		return;
+	}
+	
 	// loading and scaling
 	unsigned qP = ctx->t.QP[iYCbCr];
 	if (ctx->t.samples_clip[iYCbCr][0] == 255) {
@@ -344,6 +364,129 @@ static void add_idct8x8(Edge264Context *ctx, int iYCbCr, uint8_t *dst0)
 
 
 
+/**
+ * Add the DC values of both 8x8 chroma blocks without AC coefficients.
+ */
+static void add_dc8x8(Edge264Context *ctx, i32x4 dcCb, i32x4 dcCr)
+{
+	i32x4 s32 = set32(32); // for SSE
+	i32x4 rb = shrrs32(dcCb, 6, s32);
+	i32x4 rr = shrrs32(dcCr, 6, s32);
+	i16x8 lob = broadcastlo32(rb);
+	i16x8 hib = broadcasthi32(rb);
+	i16x8 lor = broadcastlo32(rr);
+	i16x8 hir = broadcasthi32(rr);
+	
+	// add to predicted samples
+	uint8_t *p = ctx->samples_mb[1];
+	size_t stride = ctx->t.stride[1] >> 1;
+	if (ctx->t.samples_clip[1][0] == 255) {
+		i16x8 b0 = addlou8s16(loada64(p             ), lob);
+		i16x8 r0 = addlou8s16(loada64(p + stride    ), lor);
+		i16x8 b1 = addlou8s16(loada64(p + stride * 2), lob);
+		i16x8 r1 = addlou8s16(loada64(p + stride * 3), lor);
+		i64x2 b8 = packus16(b0, b1);
+		i64x2 r8 = packus16(r0, r1);
+		*(int64_t *)(p             ) = b8[0];
+		*(int64_t *)(p + stride    ) = r8[0];
+		*(int64_t *)(p + stride * 2) = b8[1];
+		*(int64_t *)(p + stride * 3) = r8[1];
+		i16x8 b2 = addlou8s16(loada64(p += stride * 4), lob);
+		i16x8 r2 = addlou8s16(loada64(p + stride    ), lor);
+		i16x8 b3 = addlou8s16(loada64(p + stride * 2), lob);
+		i16x8 r3 = addlou8s16(loada64(p + stride * 3), lor);
+		i64x2 b9 = packus16(b2, b3);
+		i64x2 r9 = packus16(r2, r3);
+		*(int64_t *)(p             ) = b9[0];
+		*(int64_t *)(p + stride    ) = r9[0];
+		*(int64_t *)(p + stride * 2) = b9[1];
+		*(int64_t *)(p + stride * 3) = r9[1];
+		i16x8 b4 = addlou8s16(loada64(p += stride * 4), hib);
+		i16x8 r4 = addlou8s16(loada64(p + stride    ), hir);
+		i16x8 b5 = addlou8s16(loada64(p + stride * 2), hib);
+		i16x8 r5 = addlou8s16(loada64(p + stride * 3), hir);
+		i64x2 bA = packus16(b4, b5);
+		i64x2 rA = packus16(r4, r5);
+		*(int64_t *)(p             ) = bA[0];
+		*(int64_t *)(p + stride    ) = rA[0];
+		*(int64_t *)(p + stride * 2) = bA[1];
+		*(int64_t *)(p + stride * 3) = rA[1];
+		i16x8 b6 = addlou8s16(loada64(p += stride * 4), hib);
+		i16x8 r6 = addlou8s16(loada64(p + stride    ), hir);
+		i16x8 b7 = addlou8s16(loada64(p + stride * 2), hib);
+		i16x8 r7 = addlou8s16(loada64(p + stride * 3), hir);
+		i64x2 bB = packus16(b6, b7);
+		i64x2 rB = packus16(r6, r7);
+		*(int64_t *)(p             ) = bB[0];
+		*(int64_t *)(p + stride    ) = rB[0];
+		*(int64_t *)(p + stride * 2) = bB[1];
+		*(int64_t *)(p + stride * 3) = rB[1];
+	}
+}
+
+
+
+/**
+ * Add the DC values of a 16x16 block without AC coefficients, each vector
+ * holding a row of 4x4 blocks.
+ */
+static void add_dc16x16(Edge264Context *ctx, int iYCbCr, i32x4 dc0, i32x4 dc1, i32x4 dc2, i32x4 dc3)
+{
+	i32x4 s32 = set32(32);
+	i32x4 r0 = (dc0 + s32) >> 6;
+	i32x4 r1 = (dc1 + s32) >> 6;
+	i32x4 r2 = (dc2 + s32) >> 6;
+	i32x4 r3 = (dc3 + s32) >> 6;
+	i16x8 lo0 = broadcastlo32(r0);
+	i16x8 hi0 = broadcasthi32(r0);
+	i16x8 lo1 = broadcastlo32(r1);
+	i16x8 hi1 = broadcasthi32(r1);
+	i16x8 lo2 = broadcastlo32(r2);
+	i16x8 hi2 = broadcasthi32(r2);
+	i16x8 lo3 = broadcastlo32(r3);
+	i16x8 hi3 = broadcasthi32(r3);
+	
+	// add to predicted samples
+	size_t stride = ctx->t.stride[iYCbCr];
+	uint8_t *p = ctx->samples_mb[iYCbCr];
+	if (ctx->t.samples_clip[iYCbCr][0] == 255) {
+		i8x16 p0 = *(i8x16 *)(p             );
+		i8x16 p1 = *(i8x16 *)(p + stride    );
+		i8x16 p2 = *(i8x16 *)(p + stride * 2);
+		i8x16 p3 = *(i8x16 *)(p + stride * 3);
+		*(i8x16 *)(p             ) = packus16(addlou8s16(p0, lo0), addhiu8s16(p0, hi0));
+		*(i8x16 *)(p + stride    ) = packus16(addlou8s16(p1, lo0), addhiu8s16(p1, hi0));
+		*(i8x16 *)(p + stride * 2) = packus16(addlou8s16(p2, lo0), addhiu8s16(p2, hi0));
+		*(i8x16 *)(p + stride * 3) = packus16(addlou8s16(p3, lo0), addhiu8s16(p3, hi0));
+		i8x16 p4 = *(i8x16 *)(p += stride * 4);
+		i8x16 p5 = *(i8x16 *)(p + stride    );
+		i8x16 p6 = *(i8x16 *)(p + stride * 2);
+		i8x16 p7 = *(i8x16 *)(p + stride * 3);
+		*(i8x16 *)(p             ) = packus16(addlou8s16(p4, lo1), addhiu8s16(p4, hi1));
+		*(i8x16 *)(p + stride    ) = packus16(addlou8s16(p5, lo1), addhiu8s16(p5, hi1));
+		*(i8x16 *)(p + stride * 2) = packus16(addlou8s16(p6, lo1), addhiu8s16(p6, hi1));
+		*(i8x16 *)(p + stride * 3) = packus16(addlou8s16(p7, lo1), addhiu8s16(p7, hi1));
+		i8x16 p8 = *(i8x16 *)(p += stride * 4);
+		i8x16 p9 = *(i8x16 *)(p + stride    );
+		i8x16 pA = *(i8x16 *)(p + stride * 2);
+		i8x16 pB = *(i8x16 *)(p + stride * 3);
+		*(i8x16 *)(p             ) = packus16(addlou8s16(p8, lo2), addhiu8s16(p8, hi2));
+		*(i8x16 *)(p + stride    ) = packus16(addlou8s16(p9, lo2), addhiu8s16(p9, hi2));
+		*(i8x16 *)(p + stride * 2) = packus16(addlou8s16(pA, lo2), addhiu8s16(pA, hi2));
+		*(i8x16 *)(p + stride * 3) = packus16(addlou8s16(pB, lo2), addhiu8s16(pB, hi2));
+		i8x16 pC = *(i8x16 *)(p += stride * 4);
+		i8x16 pD = *(i8x16 *)(p + stride    );
+		i8x16 pE = *(i8x16 *)(p + stride * 2);
+		i8x16 pF = *(i8x16 *)(p + stride * 3);
+		*(i8x16 *)(p             ) = packus16(addlou8s16(pC, lo3), addhiu8s16(pC, hi3));
+		*(i8x16 *)(p + stride    ) = packus16(addlou8s16(pD, lo3), addhiu8s16(pD, hi3));
+		*(i8x16 *)(p + stride * 2) = packus16(addlou8s16(pE, lo3), addhiu8s16(pE, hi3));
+		*(i8x16 *)(p + stride * 3) = packus16(addlou8s16(pF, lo3), addhiu8s16(pF, hi3));
+	}
+}
+
+
+
 /**
  * DC transforms
  * 
@@ -398,58 +541,15 @@ static void transform_dc4x4(Edge264Context *ctx, int iYCbCr)
 		ctx->c_v[6] = ziplo64(dc2, dc3);
 		ctx->c_v[7] = ziphi64(dc2, dc3);
 		
-	// ... or prepare for storage in place
+	// ... or add them in place, unless deferred to the reconstruction stage
+	} else if (__builtin_expect(ctx->rec != NULL, 0)) {
+		int32_t *rec = record_op(ctx, REC_DC16x16, iYCbCr, 0, ctx->samples_mb[iYCbCr], 16);
+		memcpy(rec, &dc0, 16);
+		memcpy(rec + 4, &dc1, 16);
+		memcpy(rec + 8, &dc2, 16);
+		memcpy(rec + 12, &dc3, 16);
 	} else {
-		i32x4 r0 = (dc0 + s32) >> 6;
-		i32x4 r1 = (dc1 + s32) >> 6;
-		i32x4 r2 = (dc2 + s32) >> 6;
-		i32x4 r3 = (dc3 + s32) >> 6;
-		i16x8 lo0 = broadcastlo32(r0);
-		i16x8 hi0 = broadcasthi32(r0);
-		i16x8 lo1 = broadcastlo32(r1);
-		i16x8 hi1 = broadcasthi32(r1);
-		i16x8 lo2 = broadcastlo32(r2);
-		i16x8 hi2 = broadcasthi32(r2);
-		i16x8 lo3 = broadcastlo32(r3);
-		i16x8 hi3 = broadcasthi32(r3);
-		
-		// add to predicted samples
-		size_t stride = ctx->t.stride[iYCbCr];
-		uint8_t *p = ctx->samples_mb[iYCbCr];
-		if (ctx->t.samples_clip[iYCbCr][0] == 255) {
-			i8x16 p0 = *(i8x16 *)(p             );
-			i8x16 p1 = *(i8x16 *)(p + stride    );
-			i8x16 p2 = *(i8x16 *)(p + stride * 2);
-			i8x16 p3 = *(i8x16 *)(p + stride * 3);
-			*(i8x16 *)(p             ) = packus16(addlou8s16(p0, lo0), addhiu8s16(p0, hi0));
-			*(i8x16 *)(p + stride    ) = packus16(addlou8s16(p1, lo0), addhiu8s16(p1, hi0));
-			*(i8x16 *)(p + stride * 2) = packus16(addlou8s16(p2, lo0), addhiu8s16(p2, hi0));
-			*(i8x16 *)(p + stride * 3) = packus16(addlou8s16(p3, lo0), addhiu8s16(p3, hi0));
-			i8x16 p4 = *(i8x16 *)(p += stride * 4);
-			i8x16 p5 = *(i8x16 *)(p + stride    );
-			i8x16 p6 = *(i8x16 *)(p + stride * 2);
-			i8x16 p7 = *(i8x16 *)(p + stride * 3);
-			*(i8x16 *)(p             ) = packus16(addlou8s16(p4, lo1), addhiu8s16(p4, hi1));
-			*(i8x16 *)(p + stride    ) = packus16(addlou8s16(p5, lo1), addhiu8s16(p5, hi1));
-			*(i8x16 *)(p + stride * 2) = packus16(addlou8s16(p6, lo1), addhiu8s16(p6, hi1));
-			*(i8x16 *)(p + stride * 3) = packus16(addlou8s16(p7, lo1), addhiu8s16(p7, hi1));
-			i8x16 p8 = *(i8x16 *)(p += stride * 4);
-			i8x16 p9 = *(i8x16 *)(p + stride    );
-			i8x16 pA = *(i8x16 *)(p + stride * 2);
-			i8x16 pB = *(i8x16 *)(p + stride * 3);
-			*(i8x16 *)(p             ) = packus16(addlou8s16(p8, lo2), addhiu8s16(p8, hi2));
-			*(i8x16 *)(p + stride    ) = packus16(addlou8s16(p9, lo2), addhiu8s16(p9, hi2));
-			*(i8x16 *)(p + stride * 2) = packus16(addlou8s16(pA, lo2), addhiu8s16(pA, hi2));
-			*(i8x16 *)(p + stride * 3) = packus16(addlou8s16(pB, lo2), addhiu8s16(pB, hi2));
-			i8x16 pC = *(i8x16 *)(p += stride * 4);
-			i8x16 pD = *(i8x16 *)(p + stride    );
-			i8x16 pE = *(i8x16 *)(p + stride * 2);
-			i8x16 pF = *(i8x16 *)(p + stride * 3);
-			*(i8x16 *)(p             ) = packus16(addlou8s16(pC, lo3), addhiu8s16(pC, hi3));
-			*(i8x16 *)(p + stride    ) = packus16(addlou8s16(pD, lo3), addhiu8s16(pD, hi3));
-			*(i8x16 *)(p + stride * 2) = packus16(addlou8s16(pE, lo3), addhiu8s16(pE, hi3));
-			*(i8x16 *)(p + stride * 3) = packus16(addlou8s16(pF, lo3), addhiu8s16(pF, hi3));
-		}
+		add_dc16x16(ctx, iYCbCr, dc0, dc1, dc2, dc3);
 	}
 }
 
@@ -479,61 +579,13 @@ static void transform_dc2x2(Edge264Context *ctx)
 		ctx->c_v[4] = dcCb;
 		ctx->c_v[5] = dcCr;
 		
-	// ... or prepare for storage in place
+	// ... or add them in place, unless deferred to the reconstruction stage
+	} else if (__builtin_expect(ctx->rec != NULL, 0)) {
+		int32_t *rec = record_op(ctx, REC_DC8x8, 1, 0, ctx->samples_mb[1], 8);
+		memcpy(rec, &dcCb, 16);
+		memcpy(rec + 4, &dcCr, 16);
 	} else {
-		i32x4 s32 = set32(32); // for SSE
-		i32x4 rb = shrrs32(dcCb, 6, s32);
-		i32x4 rr = shrrs32(dcCr, 6, s32);
-		i16x8 lob = broadcastlo32(rb);
-		i16x8 hib = broadcasthi32(rb);
-		i16x8 lor = broadcastlo32(rr);
-		i16x8 hir = broadcasthi32(rr);
-		
-		// add to predicted samples
-		uint8_t *p = ctx->samples_mb[1];
-		size_t stride = ctx->t.stride[1] >> 1;
-		if (ctx->t.samples_clip[1][0] == 255) {
-			i16x8 b0 = addlou8s16(loada64(p             ), lob);
-			i16x8 r0 = addlou8s16(loada64(p + stride    ), lor);
-			i16x8 b1 = addlou8s16(loada64(p + stride * 2), lob);
-			i16x8 r1 = addlou8s16(loada64(p + stride * 3), lor);
-			i64x2 b8 = packus16(b0, b1);
-			i64x2 r8 = packus16(r0, r1);
-			*(int64_t *)(p             ) = b8[0];
-			*(int64_t *)(p + stride    ) = r8[0];
-			*(int64_t *)(p + stride * 2) = b8[1];
-			*(int64_t *)(p + stride * 3) = r8[1];
-			i16x8 b2 = addlou8s16(loada64(p += stride * 4), lob);
-			i16x8 r2 = addlou8s16(loada64(p + stride    ), lor);
-			i16x8 b3 = addlou8s16(loada64(p + stride * 2), lob);
-			i16x8 r3 = addlou8s16(loada64(p + stride * 3), lor);
-			i64x2 b9 = packus16(b2, b3);
-			i64x2 r9 = packus16(r2, r3);
-			*(int64_t *)(p             ) = b9[0];
-			*(int64_t *)(p + stride    ) = r9[0];
-			*(int64_t *)(p + stride * 2) = b9[1];
-			*(int64_t *)(p + stride * 3) = r9[1];
-			i16x8 b4 = addlou8s16(loada64(p += stride * 4), hib);
-			i16x8 r4 = addlou8s16(loada64(p + stride    ), hir);
-			i16x8 b5 = addlou8s16(loada64(p + stride * 2), hib);
-			i16x8 r5 = addlou8s16(loada64(p + stride * 3), hir);
-			i64x2 bA = packus16(b4, b5);
-			i64x2 rA = packus16(r4, r5);
-			*(int64_t *)(p             ) = bA[0];
-			*(int64_t *)(p + stride    ) = rA[0];
-			*(int64_t *)(p + stride * 2) = bA[1];
-			*(int64_t *)(p + stride * 3) = rA[1];
-			i16x8 b6 = addlou8s16(loada64(p += stride * 4), hib);
-			i16x8 r6 = addlou8s16(loada64(p + stride    ), hir);
-			i16x8 b7 = addlou8s16(loada64(p + stride * 2), hib);
-			i16x8 r7 = addlou8s16(loada64(p + stride * 3), hir);
-			i64x2 bB = packus16(b6, b7);
-			i64x2 rB = packus16(r6, r7);
-			*(int64_t *)(p             ) = bB[0];
-			*(int64_t *)(p + stride    ) = rB[0];
-			*(int64_t *)(p + stride * 2) = bB[1];
-			*(int64_t *)(p + stride * 3) = rB[1];
-		}
+		add_dc8x8(ctx, dcCb, dcCr);
 	}
 }
 
@@ -615,8 +615,13 @@ static noinline void CAFUNC(parse_NxN_residual)
 			for (int i4x4 = 0; i4x4 < 16; i4x4++) {
 				size_t stride = ctx->t.stride[iYCbCr];
 				uint8_t *samples = ctx->samples_mb[iYCbCr] + y444[i4x4] * stride + x444[i4x4];
-				if (!mb->mbIsInterFlag)
-					decode_intra4x4(samples, stride, Intra4x4Modes[mb->Intra4x4PredMode[i4x4]][ctx->unavail4x4[i4x4]], ctx->t.samples_clip_v[iYCbCr]);
+				if (!mb->mbIsInterFlag) {
+					int mode = Intra4x4Modes[mb->Intra4x4PredMode[i4x4]][ctx->unavail4x4[i4x4]];
+					if (__builtin_expect(ctx->rec != NULL, 0))
+						record_op(ctx, REC_INTRA4x4, iYCbCr, mode, samples, 0);
+					else
+						decode_intra4x4(samples, stride, mode, ctx->t.samples_clip_v[iYCbCr]);
+				}
 				if (mb->bits[0] & 1 << bit8x8[i4x4 >> 2]) {
 					int nA = *((int8_t *)mb->nC + iYCbCr * 16 + ctx->A4x4_int8[i4x4]);
 					int nB = *((int8_t *)mb->nC + iYCbCr * 16 + ctx->B4x4_int8[i4x4]);
@@ -645,8 +650,13 @@ static noinline void CAFUNC(parse_NxN_residual)
 			for (int i8x8 = 0; i8x8 < 4; i8x8++) {
 				size_t stride = ctx->t.stride[iYCbCr];
 				uint8_t *samples = ctx->samples_mb[iYCbCr] + y444[i8x8 * 4] * stride + x444[i8x8 * 4];
-				if (!mb->mbIsInterFlag)
-					decode_intra8x8(samples, stride, Intra8x8Modes[mb->Intra4x4PredMode[i8x8 * 4]][ctx->unavail4x4[i8x8 * 5]], ctx->t.samples_clip_v[iYCbCr]);
+				if (!mb->mbIsInterFlag) {
+					int mode = Intra8x8Modes[mb->Intra4x4PredMode[i8x8 * 4]][ctx->unavail4x4[i8x8 * 5]];
+					if (__builtin_expect(ctx->rec != NULL, 0))
+						record_op(ctx, REC_INTRA8x8, iYCbCr, mode, samples, 0);
+					else
+						decode_intra8x8(samples, stride, mode, ctx->t.samples_clip_v[iYCbCr]);
+				}
 				if (mb->bits[0] & 1 << bit8x8[i8x8]) {
 					#if !CABAC
 						for (int i4x4 = 0; i4x4 < 4; i4x4++) {
@@ -737,7 +747,10 @@ static inline void CAFUNC(parse_intra_chroma_pred_mode)
 			mb->f.intra_chroma_pred_mode_non_zero = (mode > 0);
 		#endif
 		log_mb(ctx, "%sintra_chroma_pred_mode: %u\n", ctx->log_indent, mode);
-		decode_intraChroma(ctx->samples_mb[1], ctx->t.stride[1] >> 1, IntraChromaModes[mode][ctx->unavail4x4[0] & 3], ctx->t.samples_clip_v[1]);
+		if (__builtin_expect(ctx->rec != NULL, 0))
+			record_op(ctx, REC_INTRA_CHROMA, 1, IntraChromaModes[mode][ctx->unavail4x4[0] & 3], ctx->samples_mb[1], 0);
+		else
+			decode_intraChroma(ctx->samples_mb[1], ctx->t.stride[1] >> 1, IntraChromaModes[mode][ctx->unavail4x4[0] & 3], ctx->t.samples_clip_v[1]);
 	}
 }
 
@@ -878,7 +891,10 @@ static noinline void CAFUNC(parse_I_mb, int mb_type_or_ctxIdx)
 			{I16x16_P_8 , I16x16_DC_A_8, I16x16_DC_B_8, I16x16_DC_AB_8},
 		};
 		mb->Intra4x4PredMode_v = (i8x16){2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2};
-		decode_intra16x16(ctx->samples_mb[0], ctx->t.stride[0], Intra16x16Modes[mode][ctx->unavail4x4[0] & 3], ctx->t.samples_clip_v[0]); // FIXME 4:4:4
+		if (__builtin_expect(ctx->rec != NULL, 0))
+			record_op(ctx, REC_INTRA16x16, 0, Intra16x16Modes[mode][ctx->unavail4x4[0] & 3], ctx->samples_mb[0], 0);
+		else
+			decode_intra16x16(ctx->samples_mb[0], ctx->t.stride[0], Intra16x16Modes[mode][ctx->unavail4x4[0] & 3], ctx->t.samples_clip_v[0]); // FIXME 4:4:4
 		CACALL(parse_intra_chroma_pred_mode);
 		CAJUMP(parse_Intra16x16_residual);
 		
@@ -1644,6 +1660,31 @@ static void CAFUNC(parse_P_mb)
 
 
 
+/**
+ * With EDGE264_MB_WINDOW, the mbs of non-reference pictures are decoded in
+ * MB_WINDOW_ROWS rows of mb_buffer, where the first two rows hold the rows
+ * above the current one, needed for prediction and lagging deblocking. Rows
+ * then alternate between the last two, which are moved to the first two each
+ * time the current row would leave the window.
+ */
+#if !CABAC
+	static always_inline int window_row(int mby) {
+		return mby < MB_WINDOW_ROWS ? mby : MB_WINDOW_ROWS - 2 + (mby - MB_WINDOW_ROWS + 2) % 2;
+	}
+	
+	static void start_window_row(Edge264Context *ctx) {
+		int row = window_row(ctx->mby);
+		int stride = ctx->t.pic_width_in_mbs + 1;
+		if (row == MB_WINDOW_ROWS - 2 && ctx->mby > row)
+			memcpy(ctx->t.mb_buffer, ctx->t.mb_buffer + row * stride, 2 * stride * sizeof(Edge264Macroblock));
+		ctx->_mb = ctx->t.mb_buffer + row * stride;
+		for (int i = 0; i < ctx->t.pic_width_in_mbs; i++)
+			ctx->_mb[i].recovery_bits = ctx->t.frame_flip_bit ^ 1;
+	}
+#endif
+
+
+
 /**
  * This function loops through the macroblocks of a slice, initialising their
  * data and calling parse_{I/P/B}_mb for each one.
@@ -1782,16 +1823,22 @@ static noinline void CAFUNC(parse_slice_data)
 			mb->bits_l = (mbA->bits_l >> 3 & 0x11111100111111) | (mbB->bits_l >> 1 & 0x42424200424242);
 		}
 		mb->nC_v[0] = mb->nC_v[1] = mb->nC_v[2] = (i8x16){};
+		if (__builtin_expect(ctx->rec != NULL, 0))
+			ctx->rec = ctx->rec_slot + 2;
 		
 		// Would it actually help to push this test outside the loop?
 		if (ctx->t.slice_type == 0) {
 			CACALL(parse_P_mb);
 		} else if (ctx->t.slice_type == 1) {
-			const Edge264Macroblock *mbCol = ctx->mbCol;
-			__builtin_prefetch(&mbCol->f);
-			__builtin_prefetch(&mbCol->mvs_v[0]);
-			__builtin_prefetch(&mbCol->mvs_v[4]);
-			__builtin_prefetch(&mbCol->mvs_v[7]);
+			if (ctx->t.direct_8x8_inference_flag) {
+				__builtin_prefetch(ctx->t.motionCol_buffer + (ctx->mbCol - ctx->t.mbCol_buffer));
+			} else {
+				const Edge264Macroblock *mbCol = ctx->mbCol;
+				__builtin_prefetch(&mbCol->f);
+				__builtin_prefetch(&mbCol->mvs_v[0]);
+				__builtin_prefetch(&mbCol->mvs_v[4]);
+				__builtin_prefetch(&mbCol->mvs_v[7]);
+			}
 			CACALL(parse_B_mb);
 		} else {
 			int mb_type_or_ctxIdx = CACOND(get_ue16(&ctx->t.gb, 25), 5 - ctx->inc.mb_type_I_NxN);
@@ -1805,6 +1852,17 @@ static noinline void CAFUNC(parse_slice_data)
 			log_mb(ctx, "%send_of_slice_flag: %u\n", ctx->log_indent, end_of_slice_flag);
 		#endif
 		print_mb(ctx);
+		if (ctx->t.motion_buffer != NULL) // none for non-reference pictures in mb_window_buffer, or without direct_8x8_inference_flag
+			store_mb_motion(ctx);
+		
+		// close the slot of recorded operations, with the QP they need
+		if (__builtin_expect(ctx->rec != NULL, 0)) {
+			ctx->rec_slot[0] = ctx->rec - ctx->rec_slot;
+			ctx->rec_slot[1] = (int32_t)ctx->t.QP_s;
+			ctx->rec_slot += REC_SLOT_WORDS;
+			if (ctx->rec_slot == ctx->rec_ring_end)
+				ctx->rec_slot = ctx->rec_ring;
+		}
 		
 		// deblock mbB while in cache, then point to the next macroblock
 		if (ctx->CurrMbAddr - ctx->t.pic_width_in_mbs == ctx->t.next_deblock_addr) {
@@ -1835,12 +1893,21 @@ static noinline void CAFUNC(parse_slice_data)
 			ctx->samples_mb[0] += ctx->t.stride[0] * 16 - ctx->t.pic_width_in_mbs * 16;
 			ctx->samples_mb[1] += ctx->t.stride[1] * 8 - ctx->t.pic_width_in_mbs * 8; // FIXME 4:2:2
 			ctx->samples_mb[2] += ctx->t.stride[1] * 8 - ctx->t.pic_width_in_mbs * 8;
+			if (ctx->t.mb_window && ctx->mby < ctx->t.pic_height_in_mbs)
+				start_window_row(ctx);
+			if (__atomic_load_n(&ctx->d->cancel_tasks, __ATOMIC_RELAXED))
+				return; // edge264_flush interrupts the slice as if it were truncated
 			if (ctx->t.next_deblock_idc >= 0) {
 				__atomic_store_n(&ctx->d->next_deblock_addr[ctx->t.next_deblock_idc],
 					(ctx->t.disable_deblocking_filter_idc != 1) ? ctx->t.next_deblock_addr : ctx->CurrMbAddr,
 					__ATOMIC_RELEASE);
-				// not locking mutex here is fine since the last progress broadcast will lock it
-				pthread_cond_broadcast(&ctx->d->task_progress);
+				if (ctx->thread_id >= 0)
+					unpark(ctx->d->pool, &ctx->d->next_deblock_addr[ctx->t.next_deblock_idc]);
+			} else if (ctx->t.stage_task >= 0) {
+				__atomic_store_n(&ctx->d->decoded_mbs[ctx->t.stage_task], ctx->CurrMbAddr, __ATOMIC_RELEASE);
+				unpark(ctx->d->pool, &ctx->d->decoded_mbs[ctx->t.stage_task]);
+				if (ctx->rec != NULL && ctx->mby < ctx->t.pic_height_in_mbs)
+					wait_recon_room(ctx);
 			}
 			if (ctx->mby >= ctx->t.pic_height_in_mbs)
 				return;
@@ -139,6 +139,8 @@ static int enable_yuv = 1;
 static const char *moveup = "";
 FILE *trace_file = NULL;
 static Edge264Decoder *d;
+static Edge264Pool *gop_pool; // decodes GOPs in parallel if not NULL
+static int gop_flags;
 static Edge264Frame out;
 static const uint8_t *conf[2];
 static SDL_Window *window;
@@ -204,6 +206,20 @@ static int draw_frame()
 
 
 
+// compare n samples with a packed row of the conformance file, skipping Cr in interleaved chroma
+static int cmp_samples(const uint8_t *p, const uint8_t *q, int n, int depth, int interleaved)
+{
+	if (!interleaved)
+		return memcmp(p, q, n << depth);
+	for (int x = 0; x < n; x++) {
+		if (memcmp(p + (x << depth << 1), q + (x << depth), 1 << depth))
+			return 1;
+	}
+	return 0;
+}
+
+
+
 static int check_frame()
 {
 	// check that the number of returned views is as expected
@@ -229,6 +245,7 @@ static int check_frame()
 					int depth = (iYCbCr == 0 ? out.bit_depth_Y : out.bit_depth_C) > 8;
 					int sh_width = (iYCbCr > 0 && out.width_C < out.width_Y);
 					int sh_height = (iYCbCr > 0 && out.height_C < out.height_Y);
+					int il = (iYCbCr > 0 && out.interleaved_CbCr);
 					const uint8_t *p = (view ? out.samples_mvc : out.samples)[iYCbCr];
 					const uint8_t *q = conf[view] +
 						(iYCbCr > 0) * (out.bit_depth_Y == 8 ? out.width_Y : out.width_Y << 1) * out.height_Y +
@@ -237,7 +254,7 @@ static int check_frame()
 					int xr = min(col * 16 - cropl + 16, out.width_Y) >> sh_width;
 					int invalid = 0;
 					for (int y = max(row * 16 - cropt, 0) >> sh_height; xl < xr && y < min(row * 16 - cropt + 16, out.height_Y) >> sh_height; y++)
-						invalid |= memcmp(p + y * stride + (xl << depth), q + y * (out.width_Y >> sh_width << depth) + (xl << depth), (xr - xl) << depth);
+						invalid |= cmp_samples(p + y * stride + (xl << depth << il), q + y * (out.width_Y >> sh_width << depth) + (xl << depth), xr - xl, depth, il);
 					if (invalid) {
 						printf("Erroneous macroblock (id %d, row %d, column %d, %s plane):\n",
 							id, row, col, (iYCbCr == 0) ? "Luma" : (iYCbCr == 1) ? "Cb" : "Cr");
@@ -245,8 +262,8 @@ static int check_frame()
 							for (int x = (col * 16 - cropl) >> sh_width; x < (col * 16 - cropl + 16) >> sh_width; x++) {
 								// FIXME 16 bit
 								printf(y < 0 || y >= out.height_Y >> sh_height || x < 0 || x >= out.width_Y >> sh_width ? "    " :
-									p[y * stride + x] == q[y * (out.width_Y >> sh_width) + x] ? " %3d" :
-									RED " %3d" RESET, p[y * stride + x]);
+									p[y * stride + (x << il)] == q[y * (out.width_Y >> sh_width) + x] ? " %3d" :
+									RED " %3d" RESET, p[y * stride + (x << il)]);
 							}
 							printf("\n");
 						}
@@ -273,6 +290,15 @@ static int check_frame()
 
 
 
+// check frames in GOP order, copying them to out as in the sequential loop
+static int output_frame(const Edge264Frame *frame, void *arg)
+{
+	out = *frame;
+	return conf[0] != NULL && check_frame() ? EBADMSG : 0;
+}
+
+
+
 static int decode_file(const char *name0)
 {
 	// process file names
@@ -357,28 +383,31 @@ static int decode_file(const char *name0)
 		moveup = "\e[A\e[K";
 		
 		// decode the entire file and FAIL on any error
-		nal += 3 + (nal[2] == 0); // skip the [0]001 delimiter
 		int res;
-		do {
-			const uint8_t *end = edge264_find_start_code(nal, end0, 0);
-			res = edge264_decode_NAL(d, nal, end, NULL, NULL);
-			while (!edge264_get_frame(d, &out, 0)) {
-				if (conf[0] != NULL && check_frame()) {
-					res = EBADMSG;
-					break;
-				} else if (display && draw_frame()) {
-					res = ENODATA;
-					quit = 1;
-					break;
+		if (gop_pool != NULL) {
+			res = edge264_decode_gops(gop_pool, 0, nal, end0, gop_flags, output_frame, NULL);
+		} else {
+			nal += 3 + (nal[2] == 0); // skip the [0]001 delimiter
+			do {
+				const uint8_t *end = edge264_find_start_code(nal, end0, 0);
+				res = edge264_decode_NAL(d, nal, end, NULL, NULL);
+				while (!edge264_get_frame(d, &out, 0)) {
+					if (conf[0] != NULL && check_frame()) {
+						res = EBADMSG;
+						break;
+					} else if (display && draw_frame()) {
+						res = ENODATA;
+						quit = 1;
+						break;
+					}
 				}
-			}
-			if (res != ENOBUFS)
-				nal = end + 3;
-		} while (res == 0 || res == ENOBUFS);
-		edge264_flush(d);
+				if (res != ENOBUFS)
+					nal = end + 3;
+			} while (res == 0 || res == ENOBUFS);
+			edge264_flush(d);
+		}
 		if (res == ENOBUFS || (res == ENODATA && conf[0] != NULL && conf[0] != end1))
 			res = EBADMSG;
-		// FIXME interrupt all threads before closing the files!
 		
 		// print the file that was decoded
 		count_pass += res == ENODATA;
@@ -431,6 +460,8 @@ int main(int argc, char *argv[])
 	int benchmark = 0;
 	int help = 0;
 	int n_threads = 0;
+	int flags = 0;
+	int gops = 0;
 	int trace = 0;
 	for (int i = 1; i < argc; i++) {
 		if (argv[i][0] != '-') {
@@ -438,12 +469,20 @@ int main(int argc, char *argv[])
 		} else for (int j = 1; argv[i][j]; j++) {
 			switch (argv[i][j]) {
 				case 'b': benchmark = 1; break;
+				case 'c': flags |= EDGE264_CALLER_TASKS; break;
 				case 'd': display = 1; break;
+				case 'D': flags |= EDGE264_DEBLOCK_STAGE; break;
 				case 'f': print_failed = 1; break;
+				case 'F': flags |= EDGE264_FIFO_TASKS; break;
+				case 'g': gops = 1; break;
+				case 'H': flags |= EDGE264_HUGE_PAGES; break;
 				case 'm': n_threads = -1; break;
+				case 'N': flags |= EDGE264_NV12; break;
 				case 'p': print_passed = 1; break;
+				case 'R': flags |= EDGE264_RECON_STAGE; break;
 				case 'u': print_unsupported = 1; break;
 				case 'v': trace = 1; break;
+				case 'w': flags |= EDGE264_MB_WINDOW; break;
 				case 'V': trace = 2; n_threads = 0; break;
 				case 'y': enable_yuv = 0; break;
 				default: help = 1; break;
@@ -453,18 +492,26 @@ int main(int argc, char *argv[])
 	
 	// print help if any argument was unknown
 	if (help) {
-		printf("Usage: " BOLD "%s [video.264|directory] [-hbdfmpuvVy]" RESET "\n"
+		printf("Usage: " BOLD "%s [video.264|directory] [-hbcdDfFgHmNpRuvVwy]" RESET "\n"
 			"Decodes a video or all videos inside a directory (./conformance by default),\n"
 			"comparing their outputs with inferred YUV pairs (.yuv and .1.yuv extensions).\n"
 			"-h\tprint this help and exit\n"
 			"-b\tbenchmark decoding time and memory usage\n"
+			"-c\twith -m, run slices in the calling thread while it waits for workers\n"
 			"-d\tenable display of the videos (requires SDL2)\n"
+			"-D\twith -m, deblock slices on a second worker behind their decoding\n"
 			"-f\tprint names of failed files in directory\n"
+			"-F\twith -m, run slices in decoding order instead of critical path first\n"
+			"-g\tdecode the GOPs between IDR pictures in parallel on all cores (without -d/-v)\n"
+			"-H\tallocate frames in huge pages, to compare against without it with -b\n"
 			"-m\tenable multi-threading (experimental)\n"
+			"-N\toutput chroma as interleaved CbCr (NV12) and check it (without -d)\n"
 			"-p\tprint names of passed files in directory\n"
+			"-R\twith -m, reconstruct frames on a second worker behind their parsing\n"
 			"-u\tprint names of unsupported files in directory\n"
 			"-v\tenable output of headers to file trace.yaml (large)\n"
 			"-V\tadd output of macroblocks to trace.yaml (very large, implies -vs)\n"
+			"-w\twithout -m, decode non-reference pictures with a few rows of macroblock data\n"
 			"-y\tdisable comparison against YUV pairs\n"
 			, argv[0]);
 		return 0;
@@ -478,10 +525,16 @@ int main(int argc, char *argv[])
 	// load SDL2 if requested
 	if (display && load_SDL2())
 		return 1;
+	if (display)
+		flags &= ~EDGE264_NV12; // SDL textures are updated from planar chroma
 	
 	struct timespec t0, t1;
 	clock_gettime(CLOCK_MONOTONIC, &t0);
-	d = edge264_alloc(n_threads, trace ? (int(*)(const char*, void*))fputs : NULL, trace_file, trace > 1, NULL, NULL, NULL);
+	if (gops && !display && !trace) {
+		gop_pool = edge264_pool_alloc(-1, NULL);
+		gop_flags = flags;
+	}
+	d = edge264_alloc(n_threads, trace ? (int(*)(const char*, void*))fputs : NULL, trace_file, flags | (trace > 1 ? EDGE264_LOG_MBS : 0), NULL, NULL, NULL);
 	
 	// check if input is a directory by trying to move into it
 	if (chdir(file_name) < 0) {
@@ -507,6 +560,7 @@ int main(int argc, char *argv[])
 	else
 		printf("%s%d " GREEN "PASS" RESET ", %d " YELLOW "UNSUPPORTED" RESET ", %d " RED "FAIL" RESET "\n", moveup, count_pass, count_unsup, count_fail);
 	edge264_free(&d);
+	edge264_pool_free(&gop_pool);
 	
 	// close SDL if enabled
 	if (display) {